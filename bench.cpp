@@ -0,0 +1,332 @@
+// Benchmark suite for the repository engine (the `bench` target). Each case
+// is timed in batches sized to run for a fixed time; the JSON written to
+// stdout (or --out) lists the median and fastest batch per operation, so
+// runs from different releases can be compared mechanically. Progress goes
+// to stderr. Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+#include "repo.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace vcs;
+
+namespace {
+
+struct Options {
+    bool   quick{false};        // smaller sizes and shorter batches, for a smoke run
+    double min_time{0.25};      // seconds per case, split across kSamples batches
+    string filter;              // run only cases whose name contains this
+    string out_path;            // JSON destination; stdout if empty
+};
+
+struct Measurement {
+    string name;
+    vector<pair<string, uint64_t>> params;
+    uint64_t iterations{};
+    double   ns_median{};
+    double   ns_min{};
+    uint64_t bytes_per_op{};    // 0 when throughput is meaningless
+};
+
+constexpr int kSamples = 5;
+
+volatile uint64_t sink;         // keeps timed results from being optimized away
+
+class Suite {
+public:
+    explicit Suite(Options o) : opt(std::move(o)) {}
+
+    bool wants(string_view name) const { return opt.filter.empty() || name.find(opt.filter) != string_view::npos; }
+    bool quick() const { return opt.quick; }
+
+    // Times op() and records ns per call. Batches double in size until one
+    // takes min_time / kSamples; max_iters bounds the calls of the whole case,
+    // for operations that grow the repository.
+    template <class F>
+    void run(string name, vector<pair<string, uint64_t>> params, uint64_t bytes_per_op, F&& op,
+             uint64_t max_iters = UINT64_MAX) {
+        if (!wants(name)) return;
+        using clk = chrono::steady_clock;
+        auto batch = [&](uint64_t n) {
+            auto t0 = clk::now();
+            for (uint64_t i = 0; i < n; ++i) op();
+            return chrono::duration<double, nano>(clk::now() - t0).count();
+        };
+
+        double target_ns = opt.min_time * 1e9 / kSamples;
+        uint64_t cap = max<uint64_t>(1, max_iters / (kSamples + 1));
+        uint64_t n = 1, total = 0;
+        for (;;) {
+            double ns = batch(n);
+            total += n;
+            if (ns >= target_ns || n >= cap) break;
+            n = min(cap, ns > 0 ? max(n * 2, uint64_t(double(n) * target_ns / ns * 1.2)) : n * 2);
+        }
+        n = min(n, max<uint64_t>(1, (max_iters - min(total, max_iters)) / kSamples));
+
+        array<double, kSamples> per_op;
+        for (double& s : per_op) s = batch(n) / double(n);
+        sort(per_op.begin(), per_op.end());
+
+        Measurement r{std::move(name), std::move(params), n * kSamples, per_op[kSamples / 2], per_op[0], bytes_per_op};
+        cerr << left << setw(22) << r.name;
+        for (const auto& [k, v] : r.params) cerr << " " << k << "=" << v;
+        cerr << "  " << fixed << setprecision(1) << r.ns_median << " ns";
+        if (bytes_per_op) cerr << "  " << setprecision(0) << double(bytes_per_op) / r.ns_median * 1e9 / (1 << 20) << " MiB/s";
+        cerr << "\n" << right;
+        results.push_back(std::move(r));
+    }
+
+    string json() const {
+        string s = "{\n  \"context\": {\"date\": ";
+        append_quoted(s, fmt_time_local(Repo::now_ns()));
+        s += ", \"compiler\": ";
+#if defined(__VERSION__)
+        append_quoted(s, __VERSION__);
+#else
+        s += "\"unknown\"";
+#endif
+#if defined(__OPTIMIZE__) || defined(NDEBUG)
+        s += ", \"optimized\": true";
+#else
+        s += ", \"optimized\": false";
+#endif
+        s += ", \"hardware_threads\": ";
+        append_number(s, thread::hardware_concurrency());
+        s += ", \"quick\": ";
+        s += opt.quick ? "true" : "false";
+        s += "},\n  \"benchmarks\": [";
+        char buf[32];
+        auto number = [&](double x) {
+            auto [p, ec] = to_chars(buf, buf + sizeof buf, x, chars_format::fixed, 2);
+            s.append(buf, p);
+        };
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Measurement& r = results[i];
+            s += i ? ",\n    {\"name\": " : "\n    {\"name\": ";
+            append_quoted(s, r.name);
+            s += ", \"params\": {";
+            for (size_t k = 0; k < r.params.size(); ++k) {
+                if (k) s += ", ";
+                append_quoted(s, r.params[k].first);
+                s += ": ";
+                append_number(s, r.params[k].second);
+            }
+            s += "}, \"iterations\": ";
+            append_number(s, r.iterations);
+            s += ", \"ns_per_op\": ";
+            number(r.ns_median);
+            s += ", \"ns_per_op_min\": ";
+            number(r.ns_min);
+            if (r.bytes_per_op) {
+                s += ", \"bytes_per_second\": ";
+                number(double(r.bytes_per_op) / r.ns_median * 1e9);
+            }
+            s += "}";
+        }
+        s += "\n  ]\n}\n";
+        return s;
+    }
+
+private:
+    Options opt;
+    vector<Measurement> results;
+};
+
+// Line-structured text of about `bytes` bytes, reproducible from the seed.
+string make_text(size_t bytes, uint64_t seed) {
+    static const char* words[] = {"alpha", "beta", "gamma", "delta", "kappa", "omega", "sigma", "theta"};
+    mt19937_64 rng(seed);
+    string s;
+    s.reserve(bytes + 8);
+    while (s.size() < bytes) {
+        s += words[rng() % 8];
+        s += rng() % 8 ? ' ' : '\n';
+    }
+    s.resize(bytes);
+    return s;
+}
+
+// A single-branch history of `depth` versions of `bytes` bytes each. Every
+// version overwrites a few bytes of its parent at a random spot, a small edit
+// that keeps the size fixed.
+void build_chain(Repo& repo, size_t depth, size_t bytes, uint64_t seed) {
+    mt19937_64 rng(seed);
+    repo.set_working(make_text(bytes, seed));
+    for (size_t i = 0; i < depth; ++i) {
+        string tag = to_string(i);
+        do (void)repo.replace_working(rng() % (bytes - tag.size()), tag.size(), tag);
+        while (repo.commit("v" + tag).unchanged);
+    }
+}
+
+void bench_hash(Suite& suite) {
+    for (size_t bytes : {size_t{16}, size_t{64}, size_t{4096}, size_t{1} << 20}) {
+        string text = make_text(bytes, 1);
+        suite.run("hash64", {{"bytes", bytes}}, bytes, [&] { sink = sink + hash64(text); });
+    }
+}
+
+// Each commit changes one byte, so nothing is skipped as unchanged. Every
+// version keeps its content, so the number of commits is bounded by memory.
+void bench_commit(Suite& suite) {
+    vector<size_t> sizes{1 << 10, 64 << 10, 1 << 20};
+    if (!suite.quick()) sizes.push_back(16 << 20);
+    for (size_t bytes : sizes) {
+        Repo repo;
+        string text = make_text(bytes, 2);
+        repo.set_working(text);
+        size_t i = 0;
+        suite.run("commit", {{"bytes", bytes}}, bytes, [&] {
+            size_t pos = i++ * 7919 % bytes;
+            text[pos] = text[pos] == 'a' ? 'e' : 'a';
+            (void)repo.replace_working(pos, 1, string_view(text).substr(pos, 1));
+            sink = sink + repo.commit("c").id;
+        }, max<uint64_t>(kSamples + 1, (uint64_t{1} << 30) / bytes));
+    }
+}
+
+void bench_checkout(Suite& suite) {
+    size_t depth = suite.quick() ? 1000 : 10000;
+    for (size_t bytes : {size_t{1} << 10, size_t{16} << 10}) {
+        Repo repo;
+        build_chain(repo, depth, bytes, 3);
+        mt19937_64 rng(4);
+        suite.run("checkout", {{"depth", depth}, {"bytes", bytes}}, 0, [&] {
+            (void)repo.checkout_version(1 + rng() % depth);
+            sink = sink + repo.working_size();
+        });
+        suite.run("get", {{"depth", depth}, {"bytes", bytes}}, 0, [&] {
+            sink = sink + repo.get(1 + rng() % depth)->ts_ns;
+        });
+    }
+}
+
+void bench_chain(Suite& suite) {
+    vector<size_t> depths{1000, 10000};
+    if (!suite.quick()) depths.push_back(100000);
+    for (size_t depth : depths) {
+        Repo repo;
+        build_chain(repo, depth, 256, 5);
+        VersionId tip = repo.head;
+        suite.run("chain_from", {{"depth", depth}}, 0, [&] { sink = sink + repo.chain_from(tip).size(); });
+        suite.run("log", {{"depth", depth}}, 0, [&] {
+            sink = sink + repo.log(tip, LogOptions{}, [](const Version& v) { sink = sink + v.id; });
+        });
+        LogOptions last20;
+        last20.limit = 20;
+        suite.run("log_limit", {{"depth", depth}, {"limit", 20}}, 0, [&] {
+            sink = sink + repo.log(tip, last20, [](const Version& v) { sink = sink + v.id; });
+        });
+        // --until halfway back: the walk starts at as_of() instead of the tip
+        LogOptions older = last20;
+        older.until = repo.history[depth / 2 - 1].ts_ns;
+        suite.run("log_until", {{"depth", depth}, {"limit", 20}}, 0, [&] {
+            sink = sink + repo.log(tip, older, [](const Version& v) { sink = sink + v.id; });
+        });
+    }
+}
+
+// Throughput over the size of the save file.
+void bench_persistence(Suite& suite) {
+    size_t versions = suite.quick() ? 1024 : 8192;
+    Repo repo;
+    build_chain(repo, versions, 4096, 6);
+    string path = (filesystem::temp_directory_path() / ("bench-" + to_hex(Repo::now_ns()) + ".repo")).string();
+    if (!repo.save(path)) {
+        cerr << "cannot write " << path << "\n";
+        return;
+    }
+    error_code ec;
+    uint64_t bytes = filesystem::file_size(path, ec);
+    suite.run("save", {{"versions", versions}}, bytes, [&] { sink = sink + repo.save(path).has_value(); });
+    Repo copy;
+    suite.run("load", {{"versions", versions}}, bytes, [&] { sink = sink + copy.load(path).has_value(); });
+    filesystem::remove(path, ec);
+}
+
+// Branches point at random versions of one history, as topic branches do.
+void bench_branches(Suite& suite) {
+    size_t depth = suite.quick() ? 1000 : 5000;
+    Repo repo;
+    build_chain(repo, depth, 256, 7);
+    mt19937_64 rng(8);
+    vector<size_t> counts{10, 100, 1000};
+    if (!suite.quick()) counts.push_back(10000);
+    size_t made = 0;
+    vector<string> names;
+    for (size_t count : counts) {
+        for (; made < count; ++made) {
+            names.push_back("topic-" + to_string(made));
+            (void)repo.create_branch(names.back(), 1 + rng() % depth);
+        }
+        suite.run("branch_create_delete", {{"branches", count}, {"depth", depth}}, 0, [&] {
+            (void)repo.create_branch("scratch", 1 + rng() % depth);
+            (void)repo.delete_branch("scratch");
+        });
+        suite.run("branch_switch", {{"branches", count}, {"depth", depth}}, 0, [&] {
+            (void)repo.switch_branch(names[rng() % count]);
+            sink = sink + repo.head;
+        });
+        suite.run("branches_containing", {{"branches", count}, {"depth", depth}}, 0, [&] {
+            sink = sink + repo.branches_containing(1 + rng() % depth)->size();
+        });
+    }
+}
+
+int usage(const char* argv0) {
+    cerr << "usage: " << argv0 << " [--quick] [--filter SUBSTR] [--min-time SECONDS] [--out PATH]\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        string_view a = argv[i];
+        if (a == "--quick") {
+            opt.quick = true;
+            opt.min_time = 0.05;
+        } else if (a == "--filter" && i + 1 < argc) {
+            opt.filter = argv[++i];
+        } else if (a == "--out" && i + 1 < argc) {
+            opt.out_path = argv[++i];
+        } else if (a == "--min-time" && i + 1 < argc) {
+            char* end;
+            opt.min_time = strtod(argv[++i], &end);
+            if (*end || !(opt.min_time > 0)) return usage(argv[0]);
+        } else {
+            return usage(argv[0]);
+        }
+    }
+#if !defined(__OPTIMIZE__) && !defined(NDEBUG)
+    cerr << "warning: unoptimized build; configure with -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+
+    Suite suite(opt);
+    struct Case { const char* name; void (*run)(Suite&); };
+    static const Case cases[] = {
+        {"hash64", bench_hash},
+        {"commit", bench_commit},
+        {"checkout get", bench_checkout},
+        {"chain_from log log_limit log_until", bench_chain},
+        {"save load", bench_persistence},
+        {"branch_create_delete branch_switch branches_containing", bench_branches},
+    };
+    for (const Case& c : cases)
+        if (suite.wants(c.name)) c.run(suite);
+
+    string json = suite.json();
+    if (opt.out_path.empty()) {
+        cout << json;
+        return cout ? 0 : 1;
+    }
+    ofstream os(opt.out_path, ios::binary);
+    os << json;
+    if (!os) {
+        cerr << "cannot write " << opt.out_path << "\n";
+        return 1;
+    }
+    return 0;
+}
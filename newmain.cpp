@@ -1,508 +1,2090 @@
+#include "repo.h"
+
 #include <bits/stdc++.h>
-using namespace std;
-using VersionId = uint64_t;
-
-static string fmt_time_local(int64_t ts_ns) {
-    time_t secs = (time_t)(ts_ns / 1000000000LL);
-    tm tmout{};
-#if defined(_WIN32)
-    if (localtime_s(&tmout, &secs) != 0) return string("invalid-time");
-#else
-    if (!localtime_r(&secs, &tmout)) return string("invalid-time");
+#if __has_include(<unistd.h>)
+#include <unistd.h>
 #endif
-    char buf[32];
-    if (std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmout) == 0)
-        return string("invalid-time");
-    return string(buf);
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+using namespace std;
+using namespace vcs;
+
+// Where the command handlers print. The server points it at a
+// per-request buffer on the thread running that request.
+static thread_local ostream* out_stream = &cout;
+static ostream& out() { return *out_stream; }
+
+static void print_unified_diff(const LineDiff& d, const string& a_label, const string& b_label,
+                               size_t context = 3) {
+    if (d.changes.empty()) { out() << "no differences\n"; return; }
+    string text;
+    text += "--- " + a_label + "\n+++ " + b_label + "\n";
+    auto range = [](size_t start, size_t len) {
+        if (len == 1) return to_string(start + 1);
+        return to_string(len ? start + 1 : start) + "," + to_string(len);
+    };
+    auto put = [&](char tag, string_view line) {
+        text += tag;
+        text += line;
+        if (line.empty() || line.back() != '\n') text += "\n\\ No newline at end of file\n";
+    };
+
+    const auto& ch = d.changes;
+    for (size_t g = 0; g < ch.size(); ) {
+        size_t last = g;
+        while (last + 1 < ch.size() && ch[last + 1].a - (ch[last].a + ch[last].a_len) <= 2 * context)
+            ++last;
+        size_t before = min(context, ch[g].a - (g ? ch[g - 1].a + ch[g - 1].a_len : 0));
+        size_t a_end = ch[last].a + ch[last].a_len;
+        size_t b_end = ch[last].b + ch[last].b_len;
+        size_t after = min(context, d.a_lines.size() - a_end);
+        size_t a_start = ch[g].a - before, b_start = ch[g].b - before;
+
+        text += "@@ -" + range(a_start, a_end + after - a_start)
+             + " +" + range(b_start, b_end + after - b_start) + " @@\n";
+        size_t ai = a_start;
+        for (size_t c = g; c <= last; ++c) {
+            for (; ai < ch[c].a; ++ai) put(' ', d.a_lines[ai]);
+            for (size_t i = 0; i < ch[c].a_len; ++i) put('-', d.a_lines[ch[c].a + i]);
+            for (size_t i = 0; i < ch[c].b_len; ++i) put('+', d.b_lines[ch[c].b + i]);
+            ai = ch[c].a + ch[c].a_len;
+        }
+        for (; ai < a_end + after; ++ai) put(' ', d.a_lines[ai]);
+        out().write(text.data(), static_cast<streamsize>(text.size()));
+        text.clear();
+        g = last + 1;
+    }
 }
 
-static uint64_t hash64(string_view s) {
-    constexpr uint64_t FNV_OFFSET = 1469598103934665603ULL;
-    constexpr uint64_t FNV_PRIME  = 1099511628211ULL;
-    uint64_t h = FNV_OFFSET;
-    for (unsigned char c : s) {
-        h ^= c;
-        h *= FNV_PRIME;
+// Stress test and reader-scaling benchmark for SharedRepo (--mvcc-bench).
+// One writer commits and creates or deletes branches continuously. Each reader
+// checks that its snapshot is self-consistent. The run is repeated for 1, 2,
+// 4, ... up to max_readers reader threads.
+static int run_mvcc_bench(unsigned max_readers, double seconds) {
+    SharedRepo shared;
+    atomic<uint64_t> failures{0};
+    uint64_t n = 0;
+    vector<tuple<unsigned, double, double>> rows;
+
+    vector<unsigned> counts;
+    for (unsigned r = 1; r < max_readers; r *= 2) counts.push_back(r);
+    counts.push_back(max_readers);
+
+    for (unsigned readers : counts) {
+        atomic<bool> stop{false};
+        vector<uint64_t> ops(readers, 0);
+        uint64_t commits = 0;
+        vector<thread> pool;
+        for (unsigned t = 0; t < readers; ++t) {
+            pool.emplace_back([&, t] {
+                mt19937_64 rng(t + 1);
+                uint64_t done = 0;
+                while (!stop.load(memory_order_relaxed)) {
+                    auto s = shared.read();
+                    bool ok = true;
+                    if (s->count) {
+                        VersionId id = 1 + rng() % s->count;
+                        const Version* v = s->get(id);
+                        ok = v && v->id == id && v->parent < id && v->merge_parent < id;
+                    }
+                    s->list_branches([&](string_view, VersionId tip) { ok = ok && tip <= s->count; }, "b");
+                    ok = ok && s->head <= s->count && (s->detached || s->tip(s->current_branch) == s->head);
+                    const Version* v = s->get(s->head);
+                    for (int k = 0; v && k < 16; ++k) {
+                        const Version* p = s->get(v->parent);
+                        ok = ok && (v->parent == 0 || (p && p->id < v->id));
+                        v = p;
+                    }
+                    if (!ok) failures.fetch_add(1);
+                    ++done;
+                }
+                ops[t] = done;
+            });
+        }
+        auto t0 = chrono::steady_clock::now();
+        while (chrono::duration<double>(chrono::steady_clock::now() - t0).count() < seconds) {
+            shared.write([&](Repo& r) {
+                ++n;
+                r.set_working("line " + to_string(n) + "\n");
+                r.commit("bench " + to_string(n));
+                if (n % 64 == 0) r.create_branch("b" + to_string(n / 64), r.head);
+                if (n % 64 == 32 && n > 256) r.delete_branch("b" + to_string(n / 64 - 3));
+            });
+            ++commits;
+        }
+        stop = true;
+        for (auto& th : pool) th.join();
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        rows.emplace_back(readers, accumulate(ops.begin(), ops.end(), uint64_t{0}) / secs, commits / secs);
     }
-    return h;
+
+    cout << "readers  reads/s       commits/s\n";
+    for (auto [readers, reads, writes] : rows)
+        cout << setw(7) << readers << "  " << setw(12) << fixed << setprecision(0) << reads
+             << "  " << setw(12) << writes << "\n";
+    cout << "versions " << n << ", consistency failures " << failures.load() << "\n";
+    return failures.load() ? 1 : 0;
 }
 
-static string to_hex(uint64_t x) {
-    ostringstream oss;
-    oss << hex << nouppercase << setfill('0') << setw(16) << x;
-    return oss.str();
+// Scaling curves for the task pool (--pool-bench). This builds an in-memory
+// repository, then times save, load and verify with 1, 2, 4, ... up to
+// max_threads threads.
+static int run_pool_bench(unsigned max_threads, size_t versions) {
+    Repo repo;
+    mt19937_64 rng(42);
+    static const char* words[] = {"alpha", "beta", "gamma", "delta", "kappa", "omega", "sigma", "theta"};
+    for (size_t i = 0; i < versions; ++i) {
+        string w;
+        while (w.size() < 2048) {
+            w += words[rng() % 8];
+            w += rng() % 8 ? ' ' : '\n';
+        }
+        w += to_string(i) + "\n";
+        repo.set_working(w);
+        repo.commit("bench " + to_string(i));
+    }
+    string path = (filesystem::temp_directory_path() / ("pool-bench-" + to_hex(rng()) + ".repo")).string();
+
+    vector<unsigned> counts;
+    for (unsigned t = 1; t < max_threads; t *= 2) counts.push_back(t);
+    counts.push_back(max_threads);
+    vector<array<double, 3>> ms;
+    bool ok = true;
+    for (unsigned t : counts) {
+        set_task_threads(t);
+        auto time = [](auto&& f) {
+            auto t0 = chrono::steady_clock::now();
+            f();
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        };
+        Repo copy;
+        ms.push_back({time([&] { ok = repo.save(path).has_value() && ok; }),
+                      time([&] { ok = copy.load(path).has_value() && ok; }),
+                      time([&] { ok = copy.verify().ok() && ok; })});
+    }
+    error_code ec;
+    uintmax_t bytes = filesystem::file_size(path, ec);
+    filesystem::remove(path, ec);
+
+    cout << versions << " versions, " << (bytes >> 20) << " MiB saved\n"
+         << "threads   save ms  x      load ms  x      verify ms  x\n" << fixed;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        cout << setw(7) << counts[i];
+        for (size_t k = 0; k < 3; ++k)
+            cout << setprecision(1) << setw(10 + (k == 2)) << ms[i][k] << setprecision(2) << setw(6)
+                 << ms[0][k] / ms[i][k] << " ";
+        cout << "\n";
+    }
+    if (!ok) cout << "save, load or verify failed\n";
+    return ok ? 0 : 1;
 }
 
-struct Version {
-    VersionId id{};
-    VersionId parent{};
-    int64_t   ts_ns{};
-    uint64_t  content_hash{};
-    string    message;
-    string    content;
-};
+static bool parse_log_options(TextCursor& in, LogOptions& opt) {
+    string_view tok;
+    string scratch;
+    while (in.word(tok)) {
+        if (tok == "--all") {
+            opt.all = true;
+        } else if (tok == "--reverse") {
+            opt.reverse = true;
+        } else if (tok == "--limit" || tok == "-n") {
+            string_view n;
+            if (!in.word(n) || !parse_number(n, opt.limit)) return false;
+        } else if (tok == "--since" || tok == "--until") {
+            string_view t;
+            if (!in.quoted(t, scratch)) return false;
+            optional<int64_t> ts = parse_time_ns(string(t));
+            if (!ts) return false;
+            (tok == "--since" ? opt.since : opt.until) = *ts;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void help() {
+    out() <<
+         R"(Commands:
+  set "TEXT"              Replace working content
+  append "TEXT"           Append to working content
+  erase POS LEN           Erase [POS, POS+LEN)
+  undo [N] | redo [N]     Revert or reapply the last N edits of the working content
+  commit "MSG"            Snapshot current working content (fails if no change)
+  set-file PATH           Replace working content with the contents of a file
+  append-file PATH        Append the contents of a file to working content
+  commit-file PATH "MSG"  set-file PATH, then commit "MSG"
+
+  log [--all] [OPTS]      Show history for current branch, newest first (--all: every
+                          reachable version once, tips decorated with their branches)
+                          OPTS: --limit N, --reverse (oldest first), --since TIME,
+                          --until TIME (TIME: "YYYY-MM-DD[ HH:MM[:SS]]" or epoch secs)
+  blog NAME [OPTS]        Show history for a specific branch
+  show ID                 Print content of version (ID may also be 0xHASH or a unique
+                          prefix of it, here and wherever an ID is accepted)
+  blame ID                Show the commit that last changed each line of a version
+  grep "TEXT" [--branch NAME]
+                          List versions containing TEXT (first matching line of each)
+  diff [A B]              Unified diff of working vs HEAD (or version A vs B)
+  checkout ID             Set working to version content (enter detached HEAD)
+  checkout [NAME]@{TIME}  Check out branch NAME (default: current) as it was at TIME
 
-struct Repo {
-    vector<Version> history;
-    string working;
+  branch NAME [AT_ID]     Create a new branch at HEAD or at AT_ID
+  branches [--prefix P]   List branches (sorted; only names starting with P)
+  switch NAME             Switch to branch NAME (leave detached, if any)
+  delete-branch NAME      Delete a branch (not the current one)
+  contains ID             List branches whose history contains version ID
+  gc                      Report versions unreachable from any branch or HEAD
+  verify                  Re-hash all versions and check their links and branch tips
+  merge NAME | --abort    Three-way merge branch NAME into the current branch
+  status                  Show branch/HEAD state
+  stats [reset]           Latency percentiles of commands and repository calls (or clear them)
+  stats mem [N]           Memory by structure, duplicate content, and the top N (10) versions
+                          by size and branches by the bytes only they keep reachable
 
-    unordered_map<string, VersionId> branches;
-    string current_branch{"main"};
-    bool detached{false};         
-    VersionId head{0};             
+  save FILE               Save repo (with branches) to file
+  load FILE               Load repo (with branches) from file
+  pull PEER [BRANCH...]   Fetch new versions from PEER and fast-forward its branches here
+  push PEER [BRANCH...]   Send new versions to PEER and fast-forward its branches there
+                          PEER is a repo file, a --serve socket, or !CMD (the rest of
+                          the line) that runs "newmain --stdio" or reaches one
 
-    Repo() {
-        branches[current_branch] = 0;
-        head = 0;
-    }
+  print                   Print working content
+  help                    Show this help
+  exit                    Quit
+)";
+}
+
+enum class CmdStatus { ok, error, exit };
+
+// ---- output ----
+// Repo returns data and errors; this is where the REPL turns them into text.
 
-    static int64_t now_ns() {
-        using namespace std::chrono;
-        return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+// Prints why r failed, if it did.
+template <class T>
+static bool check(const Result<T>& r) {
+    if (!r) out() << r.error().message << "\n";
+    return r.has_value();
+}
+
+// The outcome of a load: why it failed, or its warnings about rebuilt sections.
+static bool report_load(const Result<vector<string>>& r) {
+    if (!check(r)) return false;
+    for (const string& w : *r) out() << w << "\n";
+    return true;
+}
+
+static bool load_repo(Repo& repo, const string& path) { return report_load(repo.load(path)); }
+
+static void append_log_line(string& buf, const Version& v, string_view decoration) {
+    buf += "id ";
+    append_number(buf, v.id);
+    buf += decoration;
+    buf += "  parent ";
+    append_number(buf, v.parent);
+    if (v.merge_parent) {
+        buf += "  merge ";
+        append_number(buf, v.merge_parent);
     }
+    buf += "  hash 0x";
+    append_hex(buf, v.content_hash);
+    buf += "  time ";
+    append_time_local(buf, v.ts_ns);
+    buf += "  msg: ";
+    buf += v.message;
+    buf += '\n';
+}
 
-    VersionId commit(string msg) {
-        uint64_t new_hash = hash64(working);
+// Log output is assembled in a per-thread buffer that keeps its capacity
+// from one command to the next, and written to out() in large chunks.
+constexpr size_t kLogChunk = size_t{64} << 10;
 
-        if (!history.empty() && history.back().content_hash == new_hash) {
-            cout << "no content change\n";
-            return head;
-        }
+static string& log_buffer() {
+    static thread_local string buf;
+    buf.clear();
+    return buf;
+}
+
+static void flush_log(string& buf, size_t at_least = 0) {
+    if (buf.size() < at_least) return;
+    out().write(buf.data(), streamsize(buf.size()));
+    buf.clear();
+}
 
-        Version v;
-        v.id = history.size() + 1;
-        v.parent = head;
-        v.ts_ns = now_ns();
-        v.content_hash = new_hash;
-        v.message = std::move(msg);
-        v.content = working; 
-        history.push_back(std::move(v));
-        head = history.back().id;
+// R is a Repo, or a Snapshot when opt has no time bounds.
+template <class R>
+static void print_log(const R& repo, VersionId tip, const string& label, const LogOptions& opt) {
+    string& buf = log_buffer();
+    buf += "=== " + label + " ===\n";
+    size_t n = repo.log(tip, opt, [&](const Version& v) {
+        append_log_line(buf, v, v.id == tip ? " (HEAD)" : "");
+        flush_log(buf, kLogChunk);
+    });
+    if (n == 0) buf += "(no commits)\n";
+    flush_log(buf);
+}
 
-        if (!detached) {
-            branches[current_branch] = head;
-        }
-        return head;
+// Tips are decorated with the branches pointing at them, HEAD -> current.
+static void print_log_all(const Repo& repo, const LogOptions& opt) {
+    unordered_map<VersionId, string> deco;
+    auto decorate = [&](VersionId id, const string& name, bool front) {
+        if (id == 0) return;
+        string& d = deco[id];
+        if (d.empty()) d = name;
+        else d = front ? name + ", " + d : d + ", " + name;
+    };
+    for (const auto& [nm, tip] : repo.branches) {
+        if (!repo.detached && nm == repo.current_branch) continue;
+        decorate(tip, nm, false);
     }
+    if (repo.detached) decorate(repo.head, "HEAD", true);
+    else decorate(repo.head, "HEAD -> " + repo.current_branch, true);
+
+    for (auto& kv : deco) kv.second = " (" + kv.second + ")";
+
+    string& buf = log_buffer();
+    buf += "=== all branches ===\n";
+    size_t n = repo.log_all(opt, [&](const Version& v) {
+        auto it = deco.find(v.id);
+        append_log_line(buf, v, it == deco.end() ? string_view() : string_view(it->second));
+        flush_log(buf, kLogChunk);
+    });
+    if (n == 0) buf += "(no commits)\n";
+    flush_log(buf);
+}
 
-    const Version* get(VersionId id) const {
-        if (id==0 || id > history.size()) return nullptr;
-        return &history[id-1];
+// One line per branch that pull or receive-pack moves.
+static bool print_ref_update(const string& name, const Result<RefUpdate>& r) {
+    if (!r) {
+        out() << "  rejected " << name << " (" << r.error().message << ")\n";
+        return false;
+    }
+    switch (r->kind) {
+    case RefUpdate::created:
+        out() << "  new      " << name << " -> " << r->to << "\n";
+        break;
+    case RefUpdate::up_to_date:
+        out() << "  ok       " << name << " (up to date)\n";
+        break;
+    case RefUpdate::already_contains:
+        out() << "  ok       " << name << " (already contains " << r->to << ")\n";
+        break;
+    case RefUpdate::updated:
+        out() << "  updated  " << name << " " << r->from << " -> " << r->to << "\n";
+        break;
     }
+    return true;
+}
 
-    void checkout_version(VersionId id) {
-        auto* v = const_cast<Repo*>(this)->get(id);
-        if (!v) {
-            cout << "no such version\n";
-            return;
-        }
-        working = v->content;
-        head = id;
-        detached = true; 
+// ---- replication peers ----
+
+static CmdStatus run_command(Repo& repo, const string& line, string_view payload = {});
+
+// A command whose last token is "<<N" is followed by N bytes of payload.
+static optional<size_t> payload_size(string_view line) {
+    while (!line.empty() && isspace(static_cast<unsigned char>(line.back()))) line.remove_suffix(1);
+    size_t sp = line.find_last_of(" \t");
+    string_view tok = line.substr(sp == string_view::npos ? 0 : sp + 1);
+    if (tok.size() < 3 || !tok.starts_with("<<")) return nullopt;
+    size_t n = 0;
+    auto [p, ec] = from_chars(tok.data() + 2, tok.data() + tok.size(), n);
+    if (ec != errc() || p != tok.data() + tok.size()) return nullopt;
+    return n;
+}
+
+// The other side of push and pull. It runs one command, with an optional
+// payload, and returns the command's output; nullopt means the peer is gone.
+class Peer {
+public:
+    virtual ~Peer() = default;
+    virtual optional<string> request(const string& line, string_view payload = {}) = 0;
+    virtual bool finish() { return true; }
+};
+
+// A saved repository file. It has to be loaded and saved whole, so only
+// negotiation and transfer are proportional to the new history.
+class FilePeer : public Peer {
+public:
+    explicit FilePeer(string path) : path(std::move(path)) {}
+
+    bool open() { return load_repo(repo, path); }
+
+    optional<string> request(const string& line, string_view payload) override {
+        ostringstream buf;
+        ostream* saved = std::exchange(out_stream, &buf);
+        run_command(repo, line, payload);
+        out_stream = saved;
+        if (line.starts_with("receive-pack")) dirty = true;
+        return std::move(buf).str();
     }
 
-    bool switch_branch(const string& name) {
-        auto it = branches.find(name);
-        if (it == branches.end()) {
-            cout << "no such branch\n";
-            return false;
-        }
-        current_branch = name;
-        detached = false;
-        head = it->second;
+    bool finish() override { return !dirty || check(repo.save(path)); }
 
-        if (head == 0) {
-            working.clear();
-        } else {
-            const Version* v = get(head);
-            if (!v) {
-                cout << "branch head invalid, resetting\n";
-                working.clear();
-                head = 0;
-                branches[current_branch] = 0;
-            } else {
-                working = v->content;
-            }
-        }
+private:
+    string path;
+    Repo repo;
+    bool dirty{false};
+};
+
+#if defined(__linux__)
+// A peer that speaks the framed protocol (every response ends in a NUL byte):
+// a --serve socket, or a command started with pipes to its stdin and stdout,
+// such as "newmain --stdio".
+class StreamPeer : public Peer {
+public:
+    ~StreamPeer() override { finish(); }
+
+    bool connect_socket(const string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) { close(fd); return false; }
+        rfd = wfd = fd;
         return true;
     }
 
-    bool create_branch(const string& name, VersionId at) {
-        if (branches.count(name)) {
-            cout << "branch already exists\n";
-            return false;
-        }
-        if (at != 0 && !get(at)) {
-            cout << "no such version\n";
-            return false;
+    bool spawn(const string& cmd) {
+        int to_child[2], from_child[2];
+        if (pipe2(to_child, O_CLOEXEC) < 0) return false;
+        if (pipe2(from_child, O_CLOEXEC) < 0) { close(to_child[0]); close(to_child[1]); return false; }
+        child = fork();
+        if (child == 0) {
+            dup2(to_child[0], STDIN_FILENO);
+            dup2(from_child[1], STDOUT_FILENO);
+            execl("/bin/sh", "sh", "-c", cmd.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
         }
-        branches[name] = at;
-        cout << "Created branch '" << name << "' at " << at << "\n";
+        close(to_child[0]);
+        close(from_child[1]);
+        if (child < 0) { close(to_child[1]); close(from_child[0]); return false; }
+        wfd = to_child[1];
+        rfd = from_child[0];
         return true;
     }
 
-    bool delete_branch(const string& name) {
-        if (!branches.count(name)) {
-            cout << "no such branch\n";
-            return false;
+    optional<string> request(const string& line, string_view payload) override {
+        if (rfd < 0 || !send_all(line + "\n") || !send_all(payload)) return nullopt;
+        while (true) {
+            if (size_t z = pending.find('\0'); z != string::npos) {
+                string resp = pending.substr(0, z);
+                pending.erase(0, z + 1);
+                return resp;
+            }
+            char buf[64 * 1024];
+            ssize_t r = read(rfd, buf, sizeof(buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) return nullopt;
+            pending.append(buf, size_t(r));
         }
-        if (name == current_branch && !detached) {
-            cout << "cannot delete current branch\n";
+    }
+
+    bool finish() override {
+        if (wfd >= 0 && wfd != rfd) close(wfd);
+        if (rfd >= 0) close(rfd);
+        rfd = wfd = -1;
+        int st = 0;
+        if (child > 0 && waitpid(child, &st, 0) == child && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) {
+            child = -1;
             return false;
         }
-        branches.erase(name);
-        cout << "Deleted branch '" << name << "'\n";
+        child = -1;
         return true;
     }
 
-    void list_branches() const {
-        for (const auto& [nm, hid] : branches) {
-            bool is_cur = (!detached && nm == current_branch);
-            cout << (is_cur ? "* " : "  ") << nm << " -> " << hid;
-            const Version* v = (hid ? &history[hid-1] : nullptr);
-            if (v) cout << "  (hash 0x" << to_hex(v->content_hash) << " msg: " << v->message << ")";
-            cout << "\n";
+private:
+    bool send_all(string_view s) {
+        while (!s.empty()) {
+            ssize_t w = send_or_write(s);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            s.remove_prefix(size_t(w));
         }
-        if (detached) {
-            cout << "* (detached) HEAD -> " << head << "\n";
+        return true;
+    }
+    ssize_t send_or_write(string_view s) {
+        return rfd == wfd ? send(wfd, s.data(), s.size(), MSG_NOSIGNAL) : write(wfd, s.data(), s.size());
+    }
+
+    int rfd{-1}, wfd{-1};
+    pid_t child{-1};
+    string pending;
+};
+#endif
+
+// "!CMD" runs CMD as a pipe peer; a socket path connects to a --serve peer;
+// anything else is a repository file.
+static unique_ptr<Peer> open_peer(const string& spec) {
+#if defined(__linux__)
+    if (spec.starts_with("!") || filesystem::is_socket(spec)) {
+        auto p = make_unique<StreamPeer>();
+        bool ok = spec.starts_with("!") ? p->spawn(spec.substr(1)) : p->connect_socket(spec);
+        if (!ok) { out() << "cannot reach peer " << spec << "\n"; return nullptr; }
+        return p;
+    }
+#endif
+    auto p = make_unique<FilePeer>(spec);
+    if (!p->open()) return nullptr;
+    return p;
+}
+
+using RemoteRefs = vector<pair<string, uint64_t>>;
+
+static optional<RemoteRefs> fetch_refs(Peer& peer, const vector<string>& only) {
+    optional<string> resp = peer.request("refs");
+    if (!resp) { out() << "peer did not answer\n"; return nullopt; }
+    RemoteRefs refs;
+    istringstream in(*resp);
+    string name, key;
+    while (in >> std::quoted(name) >> key) {
+        uint64_t k = 0;
+        if (from_chars(key.data(), key.data() + key.size(), k, 16).ec != errc()) {
+            out() << "bad ref line from peer\n";
+            return nullopt;
         }
+        if (only.empty() || find(only.begin(), only.end(), name) != only.end()) refs.emplace_back(name, k);
+    }
+    for (const string& nm : only)
+        if (none_of(refs.begin(), refs.end(), [&](const auto& r) { return r.first == nm; }))
+            out() << "peer has no branch " << nm << "\n";
+    return refs;
+}
+
+static CmdStatus pull_from(Repo& repo, const string& spec, const vector<string>& only) {
+    unique_ptr<Peer> peer = open_peer(spec);
+    if (!peer) return CmdStatus::error;
+    optional<RemoteRefs> refs = fetch_refs(*peer, only);
+    if (!refs) return CmdStatus::error;
+
+    string want;
+    for (const auto& [nm, key] : *refs)
+        if (key && !repo.find_key(key) && want.find(to_hex(key)) == string::npos) want += " " + to_hex(key);
+    size_t added = 0;
+    if (!want.empty()) {
+        string line = "upload-pack" + want + " --have";
+        for (uint64_t k : repo.have_keys(4096)) line += " " + to_hex(k);
+        optional<string> pack = peer->request(line);
+        if (!pack) { out() << "peer did not answer\n"; return CmdStatus::error; }
+        TextCursor c{*pack};
+        Result<size_t> r = repo.apply_pack(c);
+        if (!check(r)) return CmdStatus::error;
+        added = *r;
+    }
+    out() << "Received " << added << " versions from " << spec << "\n";
+    bool ok = true;
+    for (const auto& [nm, key] : *refs) {
+        if (!key) continue;
+        VersionId id = repo.find_key(key);
+        if (!id) { out() << "  missing  " << nm << " (peer sent no version for its tip)\n"; ok = false; continue; }
+        ok = print_ref_update(nm, repo.fast_forward(nm, id)) && ok;
     }
+    bool closed = peer->finish();   // a file peer is saved even if a branch was rejected
+    return ok && closed ? CmdStatus::ok : CmdStatus::error;
+}
 
-    void status() const {
-        cout << "HEAD: " << head
-             << (detached ? " (detached)\n" : (" on branch '" + current_branch + "'\n"));
+static CmdStatus push_to(Repo& repo, const string& spec, const vector<string>& only) {
+    unique_ptr<Peer> peer = open_peer(spec);
+    if (!peer) return CmdStatus::error;
+    optional<RemoteRefs> remote = fetch_refs(*peer, {});
+    if (!remote) return CmdStatus::error;
+
+    vector<VersionId> common, wants;
+    for (const auto& kv : *remote)
+        if (VersionId id = repo.find_key(kv.second)) common.push_back(id);
+    vector<pair<string, VersionId>> updates;
+    for (const auto& [nm, hid] : repo.branches) {
+        if (!hid || (!only.empty() && find(only.begin(), only.end(), nm) == only.end())) continue;
+        updates.emplace_back(nm, hid);
+        wants.push_back(hid);
+    }
+    for (const string& nm : only)
+        if (!repo.branches.count(nm)) out() << "no branch " << nm << "\n";
+
+    vector<VersionId> ids = repo.missing_versions(wants, common);
+    string payload;
+    repo.write_pack(ids, payload);
+    payload += "refs " + to_string(updates.size()) + "\n";
+    for (const auto& [nm, hid] : updates) {
+        append_quoted(payload, nm);
+        payload += " " + to_hex(repo.key_of(hid)) + "\n";
     }
+    optional<string> resp = peer->request("receive-pack <<" + to_string(payload.size()), payload);
+    if (!resp) { out() << "peer did not answer\n"; return CmdStatus::error; }
+    out() << "Sent " << ids.size() << " versions to " << spec << "\n" << *resp;
+    bool ok = resp->find("  rejected ") == string::npos && resp->find("  missing ") == string::npos;
+    bool closed = peer->finish();   // a file peer is saved even if a branch was rejected
+    return ok && closed ? CmdStatus::ok : CmdStatus::error;
+}
 
+// ---- commands ----
+// Each command is a handler over the rest of its line. Read handlers take a
+// const Repo; the server runs them concurrently under a shared lock. Some
+// reads also have a snapshot handler, which the server runs without locking;
+// it returns nullopt, before printing anything, when the arguments need the
+// whole Repo.
 
-    
-    vector<VersionId> chain_from(VersionId tip) const {
-        vector<VersionId> out;
-        while (tip != 0) {
-            out.push_back(tip);
-            const Version* v = get(tip);
-            if (!v) break;
-            tip = v->parent;
-        }
-        return out;
+static CmdStatus usage(string_view text) {
+    out() << "usage: " << text << "\n";
+    return CmdStatus::error;
+}
+
+// The argument of set, append and commit: the rest of the line without
+// leading spaces, and without one pair of surrounding quotes.
+static string_view text_arg(TextCursor& args) {
+    string_view s = args.rest();
+    size_t p = s.find_first_not_of(' ');
+    s = p == string_view::npos ? string_view() : s.substr(p);
+    if (s.size() >= 2 && s.front() == '"' && s.back() == '"') s = s.substr(1, s.size() - 2);
+    return s;
+}
+
+static CmdStatus cmd_log(const Repo& repo, TextCursor& args) {
+    LogOptions opt;
+    if (!parse_log_options(args, opt)) return usage("log [--all] [--limit N] [--reverse] [--since TIME] [--until TIME]");
+    if (opt.all) {
+        print_log_all(repo, opt);
+    } else {
+        bool det = repo.detached;
+        VersionId tip = det ? repo.head : repo.branches.at(repo.current_branch);
+        string label = det ? "(detached)" : ("branch " + repo.current_branch);
+        print_log(repo, tip, label, opt);
     }
+    return CmdStatus::ok;
+}
 
-    void print_chain(vector<VersionId> ids, const string& label, VersionId head_id) const {
-        reverse(ids.begin(), ids.end());
-        cout << "=== " << label << " ===\n";
-        for (VersionId id : ids) {
-            const auto& v = history[id-1];
-            cout << "id " << v.id
-                 << (id == head_id ? " (HEAD)" : "")
-                 << "  parent " << v.parent
-                 << "  hash 0x" << to_hex(v.content_hash)
-                 << "  time " << fmt_time_local(v.ts_ns)
-                 << "  msg: " << v.message << "\n";
-        }
-        if (ids.empty()) cout << "(no commits)\n";
+static CmdStatus cmd_blog(const Repo& repo, TextCursor& args) {
+    string_view name;
+    LogOptions opt;
+    if (!args.word(name) || !parse_log_options(args, opt) || opt.all)
+        return usage("blog NAME [--limit N] [--reverse] [--since TIME] [--until TIME]");
+    auto it = repo.branches.find(name);
+    if (it == repo.branches.end()) { out() << "no such branch\n"; return CmdStatus::error; }
+    print_log(repo, it->second, "branch " + string(name), opt);
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_show(const Repo& repo, TextCursor& args) {
+    string_view idTok;
+    if (!args.word(idTok)) return usage("show ID");
+    auto id = repo.resolve_id(idTok);
+    if (!check(id)) return CmdStatus::error;
+    Result<string_view> text = repo.content(*id);
+    if (!check(text)) return CmdStatus::error;
+    out() << *text << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_diff(const Repo& repo, TextCursor& args) {
+    string_view aTok, bTok;
+    if (!args.word(aTok)) {
+        const Version* hv = repo.get(repo.head);
+        string a_label = hv ? "a/" + to_string(repo.head) : string("/dev/null");
+        print_unified_diff(diff_lines(hv ? string_view(hv->content) : string_view(), repo.working_content()),
+                           a_label, "b/working");
+        return CmdStatus::ok;
     }
+    if (!args.word(bTok)) return usage("diff [A B]");
+    auto ra = repo.resolve_id(aTok);
+    if (!check(ra)) return CmdStatus::error;
+    auto rb = repo.resolve_id(bTok);
+    if (!check(rb)) return CmdStatus::error;
+    VersionId a = *ra, b = *rb;
+    const Version* va = repo.get(a);
+    const Version* vb = repo.get(b);
+    if ((a != 0 && !va) || (b != 0 && !vb)) { out() << "No such version\n"; return CmdStatus::error; }
+    print_unified_diff(diff_lines(va ? string_view(va->content) : string_view(),
+                                  vb ? string_view(vb->content) : string_view()),
+                       va ? "a/" + string(aTok) : string("/dev/null"),
+                       vb ? "b/" + string(bTok) : string("/dev/null"));
+    return CmdStatus::ok;
+}
 
-    void save(const string& path) const {
-        ofstream os(path); 
-        if (!os) {
-            cout << "cannot open file for write\n";
-            return;
-        }
+static CmdStatus cmd_grep(const Repo& repo, TextCursor& args) {
+    string_view pattern, opt, name;
+    string scratch;
+    if (!args.quoted(pattern, scratch) || pattern.empty()) return usage("grep \"TEXT\" [--branch NAME]");
+    if (args.word(opt) && (opt != "--branch" || !args.word(name))) return usage("grep \"TEXT\" [--branch NAME]");
+    string branch(name);
+    Result<vector<GrepHit>> hits = repo.grep(pattern, branch.empty() ? nullptr : &branch);
+    if (!check(hits)) return CmdStatus::error;
+    for (const GrepHit& h : *hits) out() << "id " << h.id << ":" << h.line_no << ": " << h.line << "\n";
+    if (hits->empty()) out() << "no matches\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_branches(const Repo& repo, TextCursor& args) {
+    string_view opt, prefix;
+    if (args.word(opt) && (opt != "--prefix" || !args.word(prefix))) return usage("branches [--prefix P]");
+    auto [first, last] = repo.branches.prefix(prefix);
+    for (auto it = first; it != last; ++it) {
+        const auto& [nm, hid] = *it;
+        bool is_cur = (!repo.detached && nm == repo.current_branch);
+        out() << (is_cur ? "* " : "  ") << nm << " -> " << hid;
+        if (const Version* v = repo.get(hid))
+            out() << "  (hash 0x" << to_hex(v->content_hash) << " msg: " << v->message << ")";
+        out() << "\n";
+    }
+    if (repo.detached) out() << "* (detached) HEAD -> " << repo.head << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_contains(const Repo& repo, TextCursor& args) {
+    string_view idTok;
+    if (!args.word(idTok)) return usage("contains ID");
+    auto id = repo.resolve_id(idTok);
+    if (!check(id)) return CmdStatus::error;
+    Result<vector<string_view>> names = repo.branches_containing(*id);
+    if (!check(names)) return CmdStatus::error;
+    for (string_view nm : *names)
+        out() << ((!repo.detached && nm == repo.current_branch) ? "* " : "  ") << nm << "\n";
+    if (names->empty()) out() << "(no branch contains " << *id << ")\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_gc(const Repo& repo, TextCursor&) {
+    GcReport r = repo.gc();
+    out() << r.unreachable.size() << " of " << repo.history.size() << " versions unreachable (" << r.bytes
+          << " bytes)";
+    if (!r.unreachable.empty()) {
+        out() << ":";
+        for (size_t i = 0; i < min<size_t>(r.unreachable.size(), 20); ++i) out() << " " << r.unreachable[i];
+        if (r.unreachable.size() > 20) out() << " ...";
+    }
+    out() << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_verify(const Repo& repo, TextCursor&) {
+    VerifyReport r = repo.verify();
+    for (size_t i = 0; i < min<size_t>(r.bad_versions.size(), 20); ++i)
+        out() << "version " << r.bad_versions[i].first << ": " << r.bad_versions[i].second << "\n";
+    for (const auto& [nm, hid] : r.bad_tips) out() << "branch " << nm << ": tip " << hid << " does not exist\n";
+    if (r.ok()) {
+        out() << "verified " << r.versions << " versions\n";
+        return CmdStatus::ok;
+    }
+    out() << r.bad_versions.size() << " of " << r.versions << " versions and " << r.bad_tips.size()
+          << " branches failed verification\n";
+    return CmdStatus::error;
+}
+
+static CmdStatus cmd_status(const Repo& repo, TextCursor&) {
+    out() << "HEAD: " << repo.head
+         << (repo.detached ? " (detached)\n" : (" on branch '" + repo.current_branch + "'\n"));
+    if (repo.merging) out() << "merging " << repo.merging << " (commit to conclude, 'merge --abort' to drop)\n";
+    return CmdStatus::ok;
+}
+
+// "1.25 ms": three significant digits in the largest unit that keeps the
+// value at or above 1.
+static void print_duration(uint64_t ns) {
+    static const char* units[] = {"ns", "us", "ms", "s"};
+    double v = double(ns);
+    size_t u = 0;
+    for (; u + 1 < size(units) && v >= 1000; ++u) v /= 1000;
+    out() << setw(7) << fixed << setprecision(u == 0 || v >= 100 ? 0 : v >= 10 ? 1 : 2) << v << " " << left
+          << setw(2) << units[u] << right;
+}
+
+// "12.5 MiB", or plain bytes below 1 KiB.
+static string fmt_bytes(uint64_t n) {
+    static const char* units[] = {"KiB", "MiB", "GiB", "TiB"};
+    if (n < 1024) return to_string(n) + " B";
+    double v = double(n) / 1024;
+    size_t u = 0;
+    for (; u + 1 < size(units) && v >= 1024; ++u) v /= 1024;
+    char buf[32];
+    snprintf(buf, sizeof buf, v >= 100 ? "%.0f %s" : v >= 10 ? "%.1f %s" : "%.2f %s", v, units[u]);
+    return buf;
+}
+
+static CmdStatus print_memory_report(const Repo& repo, TextCursor& args) {
+    size_t top = 10;
+    string_view tok;
+    if (args.word(tok) && !parse_number(tok, top)) return usage("stats mem [N]");
+    MemoryReport r = repo.memory_report(top);
+
+    auto row = [](string_view name, uint64_t bytes, string_view note = {}) {
+        out() << "  " << left << setw(20) << name << right << setw(10) << fmt_bytes(bytes);
+        if (!note.empty()) out() << "   " << note;
+        out() << "\n";
+    };
+    out() << "memory (heap estimate)\n";
+    row("content", r.content_heap, to_string(r.versions) + " versions, " + fmt_bytes(r.content_bytes) + " of text");
+    row("messages", r.message_heap, fmt_bytes(r.message_bytes) + " of text");
+    row("history records", r.history_bytes);
+    row("branches", r.branch_bytes, to_string(repo.branches.size()) + " names");
+    row("working content", r.working_bytes, "with its undo journal");
+    for (const auto& [name, bytes] : r.indexes) row(name, bytes);
+    row("total", r.total());
+
+    uint64_t distinct_bytes = r.content_bytes - r.duplicate_bytes;
+    out() << "duplication: " << r.versions - r.distinct_contents << " of " << r.versions
+          << " versions repeat an earlier content; storing each once saves " << fmt_bytes(r.duplicate_bytes);
+    if (distinct_bytes) out() << " (ratio " << fixed << setprecision(2) << double(r.content_bytes) / double(distinct_bytes) << ")";
+    out() << "\n";
+
+    if (!r.largest.empty()) out() << "largest versions:\n";
+    for (const auto& [id, bytes] : r.largest) out() << "  " << left << setw(12) << id << right << setw(10) << fmt_bytes(bytes) << "\n";
+
+    out() << "reachable from one branch only:\n";
+    if (r.exclusive.empty()) out() << "  (none)\n";
+    for (const MemoryReport::Owner& w : span(r.exclusive).first(min(top, r.exclusive.size())))
+        out() << "  " << left << setw(20) << w.name << right << setw(8) << w.versions
+              << (w.versions == 1 ? " version " : " versions") << setw(11) << fmt_bytes(w.bytes) << "\n";
+    if (r.exclusive.size() > top) {
+        uint64_t rest = 0;
+        for (const MemoryReport::Owner& w : span(r.exclusive).subspan(top)) rest += w.bytes;
+        out() << "  ... " << r.exclusive.size() - top << " more, " << fmt_bytes(rest) << " together\n";
+    }
+    if (r.unreachable.versions)
+        out() << "  " << left << setw(20) << r.unreachable.name << right << setw(8) << r.unreachable.versions
+              << (r.unreachable.versions == 1 ? " version " : " versions") << setw(11)
+              << fmt_bytes(r.unreachable.bytes) << "\n";
+    return CmdStatus::ok;
+}
+
+// Counts marked '~' are estimated: cheap calls are timed one in
+// LatencySampler::kPeriod.
+static CmdStatus cmd_stats(const Repo& repo, TextCursor& args) {
+    string_view sub;
+    bool reset = args.word(sub);
+    if (reset && sub == "mem") return print_memory_report(repo, args);
+    if (reset && sub != "reset") return usage("stats [reset | mem [N]]");
+    if (!VCS_STATS) {
+        out() << "statistics are compiled out (VCS_STATS=0)\n";
+        return CmdStatus::error;
+    }
+    if (reset) {
+        reset_latency_histograms();
+        out() << "Statistics reset\n";
+        return CmdStatus::ok;
+    }
+    out() << "name                          count        p50        p90        p99        max\n";
+    for (const LatencyHistogram* h : latency_histograms()) {
+        LatencyHistogram::Summary s = h->summary();
+        if (s.count == 0) continue;
+        out() << left << setw(24) << h->name() << right << setw(11)
+              << (s.estimated ? "~" : "") + to_string(s.count);
+        for (uint64_t ns : {s.p50, s.p90, s.p99, s.max}) print_duration(ns);
+        out() << "\n";
+    }
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_save(const Repo& repo, TextCursor& args) {
+    string_view file;
+    if (!args.word(file)) return usage("save FILE");
+    if (!check(repo.save(string(file)))) return CmdStatus::error;
+    out() << "Saved to " << file << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_print(const Repo& repo, TextCursor&) {
+    out() << repo.working_content() << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_refs(const Repo& repo, TextCursor&) {
+    for (const auto& [nm, key] : repo.refs()) out() << std::quoted(nm) << " " << to_hex(key) << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_upload_pack(const Repo& repo, TextCursor& args) {
+    vector<VersionId> wants, common;
+    vector<VersionId>* into = &wants;
+    string_view tok;
+    while (args.word(tok)) {
+        if (tok == "--have") { into = &common; continue; }
+        uint64_t key = 0;
+        if (from_chars(tok.data(), tok.data() + tok.size(), key, 16).ec != errc())
+            return usage("upload-pack KEY... [--have KEY...]");
+        VersionId id = repo.find_key(key);
+        if (!id && into == &wants) { out() << "unknown version " << tok << "\n"; return CmdStatus::error; }
+        if (id) into->push_back(id);
+    }
+    string pack;
+    repo.write_pack(repo.missing_versions(wants, common), pack);
+    out() << pack;
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_help(const Repo&, TextCursor&) {
+    help();
+    return CmdStatus::ok;
+}
+
+// ---- snapshot handlers ----
+// The same output as the Repo handlers above, from a SharedRepo snapshot.
+
+static bool has_time_bounds(const LogOptions& opt) { return opt.since != INT64_MIN || opt.until != INT64_MAX; }
+
+static optional<CmdStatus> snap_log(const Snapshot& s, TextCursor& args) {
+    LogOptions opt;
+    if (!parse_log_options(args, opt) || opt.all || has_time_bounds(opt)) return nullopt;
+    VersionId tip = s.detached ? s.head : s.tip(s.current_branch).value_or(0);
+    print_log(s, tip, s.detached ? "(detached)" : "branch " + s.current_branch, opt);
+    return CmdStatus::ok;
+}
+
+static optional<CmdStatus> snap_blog(const Snapshot& s, TextCursor& args) {
+    string_view name;
+    LogOptions opt;
+    if (!args.word(name) || !parse_log_options(args, opt) || opt.all || has_time_bounds(opt)) return nullopt;
+    optional<VersionId> tip = s.tip(name);
+    if (!tip) return nullopt;
+    print_log(s, *tip, "branch " + string(name), opt);
+    return CmdStatus::ok;
+}
+
+// Decimal ids only; hashes need the Repo's hash index.
+static optional<CmdStatus> snap_show(const Snapshot& s, TextCursor& args) {
+    string_view tok;
+    VersionId id = 0;
+    if (!args.word(tok) || !parse_number(tok, id) || !s.get(id)) return nullopt;
+    out() << s.get(id)->content << "\n";
+    return CmdStatus::ok;
+}
+
+static optional<CmdStatus> snap_branches(const Snapshot& s, TextCursor& args) {
+    string_view opt, prefix;
+    if (args.word(opt) && (opt != "--prefix" || !args.word(prefix))) return nullopt;
+    s.list_branches([&](string_view nm, VersionId hid) {
+        bool is_cur = (!s.detached && nm == s.current_branch);
+        out() << (is_cur ? "* " : "  ") << nm << " -> " << hid;
+        if (const Version* v = s.get(hid))
+            out() << "  (hash 0x" << to_hex(v->content_hash) << " msg: " << v->message << ")";
+        out() << "\n";
+    }, prefix);
+    if (s.detached) out() << "* (detached) HEAD -> " << s.head << "\n";
+    return CmdStatus::ok;
+}
+
+static optional<CmdStatus> snap_status(const Snapshot& s, TextCursor&) {
+    out() << "HEAD: " << s.head << (s.detached ? " (detached)\n" : (" on branch '" + s.current_branch + "'\n"));
+    if (s.merging) out() << "merging " << s.merging << " (commit to conclude, 'merge --abort' to drop)\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_set(Repo& repo, TextCursor& args, string_view) {
+    repo.set_working(text_arg(args));
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_append(Repo& repo, TextCursor& args, string_view) {
+    repo.append_working(text_arg(args));
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_erase(Repo& repo, TextCursor& args, string_view) {
+    size_t p = 0, len = 0;
+    string_view pTok, lenTok;
+    if (!args.word(pTok) || !args.word(lenTok)) return usage("erase POS LEN");
+    if (!parse_number(pTok, p) || !parse_number(lenTok, len)) {
+        out() << "erase: POS and LEN must be numbers\n";
+        return CmdStatus::error;
+    }
+    if (!check(repo.erase_working(p, len))) return CmdStatus::error;
+    return CmdStatus::ok;
+}
+
+static CmdStatus undo_or_redo(Repo& repo, TextCursor& args, bool undo) {
+    string_view nTok;
+    size_t n = 1;
+    if (args.word(nTok) && (!parse_number(nTok, n) || n == 0)) return usage(undo ? "undo [N]" : "redo [N]");
+    size_t done = undo ? repo.undo(n) : repo.redo(n);
+    if (done == 0) {
+        out() << (undo ? "nothing to undo\n" : "nothing to redo\n");
+        return CmdStatus::error;
+    }
+    out() << (undo ? "Undid " : "Redid ") << done << (done == 1 ? " edit\n" : " edits\n");
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_undo(Repo& repo, TextCursor& args, string_view) { return undo_or_redo(repo, args, true); }
+static CmdStatus cmd_redo(Repo& repo, TextCursor& args, string_view) { return undo_or_redo(repo, args, false); }
+
+// The file argument of set-file, append-file and commit-file: a word, or a
+// quoted path.
+static bool read_file_arg(TextCursor& args, optional<MappedFile>& file) {
+    string_view path;
+    string scratch;
+    if (!args.quoted(path, scratch) || path.empty()) return false;
+    Result<MappedFile> f = MappedFile::open(string(path));
+    if (!f) out() << path << ": " << f.error().message << "\n";
+    else file = std::move(*f);
+    return true;
+}
+
+static CmdStatus cmd_set_file(Repo& repo, TextCursor& args, string_view) {
+    optional<MappedFile> file;
+    if (!read_file_arg(args, file)) return usage("set-file PATH");
+    if (!file) return CmdStatus::error;
+    repo.set_working(file->view());
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_append_file(Repo& repo, TextCursor& args, string_view) {
+    optional<MappedFile> file;
+    if (!read_file_arg(args, file)) return usage("append-file PATH");
+    if (!file) return CmdStatus::error;
+    repo.append_working(file->view());
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_commit(Repo& repo, TextCursor& args, string_view) {
+    CommitResult r = repo.commit(string(text_arg(args)));
+    if (r.unchanged) out() << "no content change\n";
+    out() << "Committed as " << r.id << (repo.detached ? " (detached)\n" : (" on branch " + repo.current_branch + "\n"));
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_commit_file(Repo& repo, TextCursor& args, string_view payload) {
+    optional<MappedFile> file;
+    if (!read_file_arg(args, file)) return usage("commit-file PATH \"MSG\"");
+    if (!file) return CmdStatus::error;
+    repo.set_working(file->view());
+    file.reset();
+    return cmd_commit(repo, args, payload);
+}
+
+static CmdStatus cmd_blame(Repo& repo, TextCursor& args, string_view) {
+    string_view idTok;
+    if (!args.word(idTok)) return usage("blame ID");
+    auto id = repo.resolve_id(idTok);
+    if (!check(id)) return CmdStatus::error;
+    Result<span<const VersionId>> origins = repo.blame(*id);
+    if (!check(origins)) return CmdStatus::error;
+    vector<string_view> lines = split_lines(repo.get(*id)->content);
+    size_t id_w = to_string(repo.history.size()).size();
+    size_t no_w = to_string(lines.size()).size();
+    string text;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        const Version& o = repo.history[(*origins)[i] - 1];
+        string ids = to_string(o.id), no = to_string(i + 1);
+        text.append(id_w - ids.size(), ' ') += ids;
+        text += " (";
+        append_time_local(text, o.ts_ns);
+        text += ' ';
+        text.append(no_w - no.size(), ' ') += no;
+        text += ") ";
+        text += lines[i];
+        if (lines[i].back() != '\n') text += '\n';
+    }
+    out() << text;
+    return CmdStatus::ok;
+}
 
-        os << "count " << static_cast<uint64_t>(history.size()) << "\n";
-        for (const auto& v : history) {
-            os << "id "      << static_cast<uint64_t>(v.id)           << "\n";
-            os << "parent "  << static_cast<uint64_t>(v.parent)       << "\n";
-            os << "ts_ns "   << static_cast<int64_t>(v.ts_ns)         << "\n";
-            os << "hash "    << static_cast<uint64_t>(v.content_hash) << "\n";
-            os << "message " << std::quoted(v.message)                << "\n";
-            os << "content " << std::quoted(v.content)                << "\n";
-            os << "----\n";
+static CmdStatus cmd_checkout(Repo& repo, TextCursor& args, string_view) {
+    string_view idTok;
+    if (!args.word(idTok)) return usage("checkout ID | [BRANCH]@{TIME}");
+    VersionId id{};
+    if (auto at = idTok.find("@{"); at != string_view::npos) {
+        string when = string(idTok.substr(at + 2)) + string(args.rest());
+        if (when.empty() || when.back() != '}') return usage("checkout [BRANCH]@{TIME}");
+        when.pop_back();
+        optional<int64_t> ts = parse_time_ns(when);
+        if (!ts) { out() << "invalid time\n"; return CmdStatus::error; }
+        string_view name = idTok.substr(0, at);
+        VersionId tip = repo.head;
+        if (!name.empty() || !repo.detached) {
+            auto it = repo.branches.find(name.empty() ? string_view(repo.current_branch) : name);
+            if (it == repo.branches.end()) { out() << "no such branch\n"; return CmdStatus::error; }
+            tip = it->second;
         }
+        id = repo.as_of(tip, *ts);
+        if (id == 0) { out() << "no version at or before that time\n"; return CmdStatus::error; }
+    } else {
+        auto r = repo.resolve_id(idTok);
+        if (!check(r)) return CmdStatus::error;
+        id = *r;
+    }
+    if (!check(repo.checkout_version(id))) return CmdStatus::error;
+    out() << "Checked out " << id << " (detached)\n";
+    return CmdStatus::ok;
+}
 
-        os << "branches " << branches.size() << "\n";
-        for (const auto& [nm, hid] : branches) {
-            os << "bname " << std::quoted(nm) << " bhead " << static_cast<uint64_t>(hid) << "\n";
+static CmdStatus cmd_branch(Repo& repo, TextCursor& args, string_view) {
+    string_view name, atTok;
+    if (!args.word(name)) return usage("branch NAME [AT_ID]");
+    VersionId at = repo.head;
+    if (args.word(atTok)) {
+        auto r = repo.resolve_id(atTok);
+        if (!r && r.error().code == Errc::invalid_argument) {
+            out() << "invalid AT_ID\n";
+            return CmdStatus::error;
         }
-        os << "current_branch " << std::quoted(current_branch) << "\n";
-        os << "detached " << (detached ? 1 : 0) << "\n";
+        if (!check(r)) return CmdStatus::error;
+        at = *r;
+    }
+    if (!check(repo.create_branch(string(name), at))) return CmdStatus::error;
+    out() << "Created branch '" << name << "' at " << at << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_switch(Repo& repo, TextCursor& args, string_view) {
+    string_view name;
+    if (!args.word(name)) return usage("switch NAME");
+    Result<> r = repo.switch_branch(string(name));
+    if (!check(r) && r.error().code != Errc::corrupt) return CmdStatus::error;   // corrupt: reset, still switched
+    out() << "Switched to branch " << name << "\n";
+    return CmdStatus::ok;
+}
 
-        os << "head " << static_cast<uint64_t>(head) << "\n";
+static CmdStatus cmd_delete_branch(Repo& repo, TextCursor& args, string_view) {
+    string_view name;
+    if (!args.word(name)) return usage("delete-branch NAME");
+    if (!check(repo.delete_branch(string(name)))) return CmdStatus::error;
+    out() << "Deleted branch '" << name << "'\n";
+    return CmdStatus::ok;
+}
 
-        if (!os) cout<<"write failed\n";
+static CmdStatus cmd_merge(Repo& repo, TextCursor& args, string_view) {
+    string_view name;
+    if (!args.word(name)) return usage("merge NAME | merge --abort");
+    if (name == "--abort") {
+        if (!check(repo.abort_merge())) return CmdStatus::error;
+        out() << "Merge aborted\n";
+        return CmdStatus::ok;
+    }
+    Result<MergeOutcome> m = repo.merge_branch(string(name));
+    if (!check(m)) return CmdStatus::error;
+    switch (m->kind) {
+    case MergeOutcome::up_to_date:
+        out() << "Already up to date.\n";
+        break;
+    case MergeOutcome::fast_forward:
+        out() << "Fast-forward to " << m->id << "\n";
+        break;
+    case MergeOutcome::conflicted:
+        out() << "CONFLICT: " << m->conflicts << " conflicting hunk(s) (base " << m->base
+              << "); fix the working content and commit\n";
+        return CmdStatus::error;
+    case MergeOutcome::merged:
+        out() << "Merged " << name << " (base " << m->base << ") as " << m->id << "\n";
+        break;
     }
+    return CmdStatus::ok;
+}
+
+static CmdStatus cmd_load(Repo& repo, TextCursor& args, string_view) {
+    string_view file;
+    if (!args.word(file)) return usage("load FILE");
+    if (!load_repo(repo, string(file))) return CmdStatus::error;
+    out() << "Loaded from " << file << "\n";
+    return CmdStatus::ok;
+}
+
+static CmdStatus pull_or_push(Repo& repo, TextCursor& args, bool pull) {
+    string_view peer, name;
+    vector<string> only;
+    if (!args.word(peer)) return usage(pull ? "pull PEER [BRANCH...]" : "push PEER [BRANCH...]");
+    string spec(peer);
+    if (peer.starts_with("!")) spec += args.rest();    // a command peer takes the rest of the line
+    while (args.word(name)) only.emplace_back(name);
+    return pull ? pull_from(repo, spec, only) : push_to(repo, spec, only);
+}
+
+static CmdStatus cmd_pull(Repo& repo, TextCursor& args, string_view) { return pull_or_push(repo, args, true); }
+static CmdStatus cmd_push(Repo& repo, TextCursor& args, string_view) { return pull_or_push(repo, args, false); }
+
+static CmdStatus cmd_receive_pack(Repo& repo, TextCursor& args, string_view payload) {
+    if (!payload_size(args.s)) return usage("receive-pack <<N");
+    TextCursor c{payload};
+    size_t n = 0;
+    Result<size_t> added = repo.apply_pack(c);
+    if (!check(added)) return CmdStatus::error;
+    out() << "Received " << *added << " versions\n";
+    string_view w;
+    if (!c.word(w) || w != "refs" || !c.number(n)) { out() << "bad ref list\n"; return CmdStatus::error; }
+    bool ok = true;
+    for (size_t i = 0; i < n; ++i) {
+        string_view raw;
+        string name;
+        uint64_t key = 0;
+        if (!c.quoted_raw(raw) || !c.hex(key)) { out() << "bad ref list\n"; return CmdStatus::error; }
+        TextCursor::unquote(raw, name);
+        VersionId id = repo.find_key(key);
+        if (!id) { out() << "  missing  " << name << " (pack lacks its tip)\n"; ok = false; continue; }
+        ok = print_ref_update(name, repo.fast_forward(name, id)) && ok;
+    }
+    return ok ? CmdStatus::ok : CmdStatus::error;
+}
+
+static CmdStatus cmd_exit(Repo&, TextCursor&, string_view) { return CmdStatus::exit; }
 
-    void load(const string& path) {
-        ifstream is(path);
-        if (!is) { cout<<"cannot open file for read\n"; return; }
+struct Command {
+    string_view name;
+    CmdStatus (*read)(const Repo&, TextCursor&);
+    CmdStatus (*write)(Repo&, TextCursor&, string_view payload);
+    optional<CmdStatus> (*snap)(const Snapshot&, TextCursor&) = nullptr;
+};
 
-        history.clear();
-        working.clear();
-        head = 0;
-        branches.clear();
-        current_branch = "main";
-        detached = false;
+static constexpr Command kCommands[] = {
+    {"log", cmd_log, nullptr, snap_log},
+    {"blog", cmd_blog, nullptr, snap_blog},
+    {"show", cmd_show, nullptr, snap_show},
+    {"diff", cmd_diff, nullptr},
+    {"grep", cmd_grep, nullptr},
+    {"branches", cmd_branches, nullptr, snap_branches},
+    {"contains", cmd_contains, nullptr},
+    {"gc", cmd_gc, nullptr},
+    {"verify", cmd_verify, nullptr},
+    {"status", cmd_status, nullptr, snap_status},
+    {"stats", cmd_stats, nullptr},
+    {"save", cmd_save, nullptr},
+    {"print", cmd_print, nullptr},
+    {"refs", cmd_refs, nullptr},
+    {"upload-pack", cmd_upload_pack, nullptr},
+    {"help", cmd_help, nullptr},
+    {"set", nullptr, cmd_set},
+    {"append", nullptr, cmd_append},
+    {"erase", nullptr, cmd_erase},
+    {"undo", nullptr, cmd_undo},
+    {"redo", nullptr, cmd_redo},
+    {"commit", nullptr, cmd_commit},
+    {"set-file", nullptr, cmd_set_file},
+    {"append-file", nullptr, cmd_append_file},
+    {"commit-file", nullptr, cmd_commit_file},
+    {"blame", nullptr, cmd_blame},
+    {"checkout", nullptr, cmd_checkout},
+    {"branch", nullptr, cmd_branch},
+    {"switch", nullptr, cmd_switch},
+    {"delete-branch", nullptr, cmd_delete_branch},
+    {"merge", nullptr, cmd_merge},
+    {"load", nullptr, cmd_load},
+    {"pull", nullptr, cmd_pull},
+    {"push", nullptr, cmd_push},
+    {"receive-pack", nullptr, cmd_receive_pack},
+    {"exit", nullptr, cmd_exit},
+    {"quit", nullptr, cmd_exit},
+};
 
-        string key;
-        uint64_t count = 0;
+// A perfect hash over the command names: the seed is searched for at
+// compile time so that every name lands in its own slot.
+constexpr size_t kCommandSlots = 128;
 
-        if (!(is >> key) || key != "count") { cout << "expected 'count'\n"; return; }
-        if (!(is >> count)) { cout << "bad count\n"; return; }
-        string dummy; getline(is, dummy);
+constexpr size_t command_slot(string_view name, uint64_t seed) {
+    uint64_t h = seed;
+    for (char c : name) h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    return (h ^ (h >> 32)) & (kCommandSlots - 1);
+}
 
-        history.reserve(static_cast<size_t>(count));
-        for (uint64_t i = 0; i < count; ++i) {
-            Version v{};
-            if (!(is >> key) || key != "id") { cout << "expected 'id'\n"; return; }
-            if (!(is >> v.id)) { cout << "bad id\n"; return; }
-            getline(is, dummy);
+struct CommandIndex {
+    uint64_t seed;
+    array<uint8_t, kCommandSlots> slot;    // index into kCommands, or 0xff
+};
 
-            if (!(is >> key) || key != "parent") { cout << "expected 'parent'\n"; return; }
-            if (!(is >> v.parent)) { cout << "bad parent\n"; return; }
-            getline(is, dummy);
+consteval CommandIndex build_command_index() {
+    static_assert(size(kCommands) < 0xff);
+    for (uint64_t seed = 1;; ++seed) {
+        CommandIndex ix{seed, {}};
+        ix.slot.fill(0xff);
+        bool distinct = true;
+        for (size_t i = 0; i < size(kCommands) && distinct; ++i) {
+            uint8_t& s = ix.slot[command_slot(kCommands[i].name, seed)];
+            distinct = s == 0xff;
+            s = static_cast<uint8_t>(i);
+        }
+        if (distinct) return ix;
+    }
+}
 
-            if (!(is >> key) || key != "ts_ns") { cout << "expected 'ts_ns'\n"; return; }
-            if (!(is >> v.ts_ns)) { cout << "bad ts_ns\n"; return; }
-            getline(is, dummy);
+static constexpr CommandIndex kCommandIndex = build_command_index();
 
-            if (!(is >> key) || key != "hash") { cout << "expected 'hash'\n"; return; }
-            if (!(is >> v.content_hash)) { cout << "bad hash\n"; return; }
-            getline(is, dummy);
+static const Command* find_command(string_view name) {
+    uint8_t i = kCommandIndex.slot[command_slot(name, kCommandIndex.seed)];
+    return i != 0xff && kCommands[i].name == name ? &kCommands[i] : nullptr;
+}
 
-            if (!(is >> key) || key != "message") { cout << "expected 'message'\n"; return; }
-            if (!(is >> std::quoted(v.message))) { cout << "bad message\n"; return; }
-            getline(is, dummy);
+#if VCS_STATS
+// Times one run of a command into its histogram, sampled per thread.
+class CommandTimer {
+public:
+    explicit CommandTimer(const Command& cmd)
+        : timer(*hists()[size_t(&cmd - kCommands)], samplers[size_t(&cmd - kCommands)]) {}
+
+private:
+    static const array<LatencyHistogram*, size(kCommands)>& hists() {
+        static const auto h = [] {
+            array<LatencyHistogram*, size(kCommands)> h{};
+            for (size_t i = 0; i < size(kCommands); ++i) h[i] = &latency_histogram(kCommands[i].name);
+            return h;
+        }();
+        return h;
+    }
+    static inline thread_local array<LatencySampler, size(kCommands)> samplers;
 
-            if (!(is >> key) || key != "content") { cout << "expected 'content'\n"; return; }
-            if (!(is >> std::quoted(v.content))) { cout << "bad content\n"; return; }
-            getline(is, dummy);
+    LatencyTimer timer;
+};
+#endif
 
-            if (!std::getline(is, key)) { cout << "missing separator\n"; return; }
-            if (key != "----") { cout << "expected '----'\n"; return; }
+// Runs one command line; errors have already been reported when it returns error.
+static CmdStatus run_command(Repo& repo, const string& line, string_view payload) {
+    TextCursor args{line};
+    string_view name;
+    if (!args.word(name)) return CmdStatus::ok;
+    const Command* cmd = find_command(name);
+    if (!cmd) {
+        out() << "Unknown command. Type 'help'.\n";
+        return CmdStatus::error;
+    }
+#if VCS_STATS
+    CommandTimer timer(*cmd);
+#endif
+    try {
+        return cmd->read ? cmd->read(repo, args) : cmd->write(repo, args, payload);
+    } catch (const exception& e) {
+        out() << "Error: " << e.what() << "\n";
+        return CmdStatus::error;
+    }
+}
 
-            history.push_back(std::move(v));
+// Per-line cost of parsing and dispatch alone (--dispatch-bench [LINES]):
+// the istringstream and if/else chain run_command used to have against the
+// tokenizer and command table. Neither side runs the command.
+static volatile size_t dispatch_bench_sink;    // so neither loop is optimized away
+
+static int run_dispatch_bench(size_t lines) {
+    static const string_view kLegacyOrder[] = {
+        "log", "blog", "show", "diff", "grep", "branches", "contains", "gc", "verify", "status", "save",
+        "print", "refs", "upload-pack", "help", "set", "append", "erase", "commit", "blame", "checkout",
+        "branch", "switch", "delete-branch", "merge", "load", "pull", "push", "receive-pack", "exit", "quit"};
+    const vector<string> mix = {
+        "status", "show 12", "log --limit 5", "set \"hello world\"", "commit \"fix the parser\"",
+        "branch feature 10", "diff 3 4", "append \" more text\"", "grep \"foo\" --branch main",
+        "checkout 0x1f2e", "merge feature", "frobnicate now"};
+
+    auto legacy = [&](const string& line) {
+        std::istringstream in(line);
+        string cmd;
+        in >> cmd;
+        size_t i = 0;
+        while (i < size(kLegacyOrder) && cmd != kLegacyOrder[i]) ++i;
+        size_t n = i;
+        if (cmd == "set" || cmd == "append" || cmd == "commit") {
+            string rest;
+            std::getline(in, rest);
+            auto pos = rest.find_first_not_of(' ');
+            string s = (pos == string::npos) ? string() : rest.substr(pos);
+            if (!s.empty() && s.front() == '"' && s.back() == '"' && s.size() >= 2) s = s.substr(1, s.size() - 2);
+            n += s.size();
+        } else {
+            for (string tok; in >> tok;) n += tok.size();
+        }
+        return n;
+    };
+    auto table = [&](const string& line) {
+        TextCursor args{line};
+        string_view name, tok;
+        args.word(name);
+        const Command* cmd = find_command(name);
+        size_t n = cmd ? size_t(cmd - kCommands) : size(kLegacyOrder);
+        if (cmd && (cmd->write == cmd_set || cmd->write == cmd_append || cmd->write == cmd_commit)) {
+            n += text_arg(args).size();
+        } else {
+            while (args.word(tok)) n += tok.size();
         }
+        return n;
+    };
+
+    using clk = chrono::steady_clock;
+    auto time_ns = [&](auto&& parse) {
+        size_t sink = 0;
+        auto t0 = clk::now();
+        for (size_t i = 0; i < lines; ++i) sink += parse(mix[i % mix.size()]);
+        double ns = chrono::duration<double, nano>(clk::now() - t0).count() / double(max<size_t>(lines, 1));
+        return pair(ns, sink);
+    };
+    auto [old_ns, old_sink] = time_ns(legacy);
+    auto [new_ns, new_sink] = time_ns(table);
+    cout << lines << " lines, " << mix.size() << " distinct\n" << fixed << setprecision(1)
+         << "istringstream + if/else  " << setw(7) << old_ns << " ns/line\n"
+         << "tokenizer + table        " << setw(7) << new_ns << " ns/line  (" << setprecision(2) << old_ns / new_ns
+         << "x)\n";
+    dispatch_bench_sink = old_sink + new_sink;
+    return 0;
+}
 
-        size_t bcount = 0;
-        if (!(is >> key) || key != "branches") { cout << "expected 'branches'\n"; return; }
-        if (!(is >> bcount)) { cout << "bad branches count\n"; return; }
-        getline(is, dummy);
+// Cost of rendering log lines (--format-bench [LINES]): the ostream, to_hex
+// and strftime formatting log used to do against append_log_line. Both
+// render the same synthetic versions, spread over about a year, and must
+// produce the same bytes.
+static int run_format_bench(size_t lines) {
+    mt19937_64 rng(7);
+    vector<Version> vs(min<size_t>(lines, 4096));
+    int64_t ts = Repo::now_ns() - 365LL * 86400 * 1000000000;
+    for (size_t i = 0; i < vs.size(); ++i) {
+        Version& v = vs[i];
+        v.id = i + 1;
+        v.parent = i;
+        v.merge_parent = i % 16 == 15 ? i / 2 : 0;
+        ts += int64_t(rng() % 7200) * 1000000000 + int64_t(rng() % 1000000000);
+        v.ts_ns = ts;
+        v.content_hash = rng();
+        v.message = "change " + to_string(i);
+    }
 
-        for (size_t i = 0; i < bcount; ++i) {
-            string nm;
-            VersionId hid{};
-            if (!(is >> key) || key != "bname") { cout << "expected 'bname'\n"; return; }
-            if (!(is >> std::quoted(nm))) { cout << "bad branch name\n"; return; }
-            if (!(is >> key) || key != "bhead") { cout << "expected 'bhead'\n"; return; }
-            if (!(is >> hid)) { cout << "bad bhead\n"; return; }
-            getline(is, dummy);
-            branches[nm] = hid;
+    auto legacy = [](ostream& os, const Version& v) {
+        ostringstream hex_os;
+        hex_os << hex << nouppercase << setfill('0') << setw(16) << v.content_hash;
+        time_t secs = (time_t)(v.ts_ns / 1000000000LL);
+        tm t{};
+        char when[32] = "invalid-time";
+        if (localtime_r(&secs, &t)) strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+        os << "id " << v.id << (v.id == 1 ? " (HEAD)" : "") << "  parent " << v.parent;
+        if (v.merge_parent) os << "  merge " << v.merge_parent;
+        os << "  hash 0x" << hex_os.str() << "  time " << when << "  msg: " << v.message << "\n";
+    };
+
+    ostringstream ref;
+    string mine;
+    for (const Version& v : vs) {
+        legacy(ref, v);
+        append_log_line(mine, v, v.id == 1 ? " (HEAD)" : "");
+    }
+    bool same = ref.view() == mine;
+
+    // Both sides write to a stream that discards, the new one in kLogChunk
+    // pieces as print_log does.
+    struct NullBuf : streambuf {
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char*, streamsize n) override { return n; }
+    } null_buf;
+    ostream sink(&null_buf);
+    using clk = chrono::steady_clock;
+    auto t0 = clk::now();
+    for (size_t i = 0; i < lines; ++i) legacy(sink, vs[i % vs.size()]);
+    double old_ns = chrono::duration<double, nano>(clk::now() - t0).count();
+
+    string buf;
+    t0 = clk::now();
+    for (size_t i = 0; i < lines; ++i) {
+        const Version& v = vs[i % vs.size()];
+        append_log_line(buf, v, v.id == 1 ? " (HEAD)" : "");
+        if (buf.size() >= kLogChunk) {
+            sink.write(buf.data(), streamsize(buf.size()));
+            buf.clear();
         }
+    }
+    double new_ns = chrono::duration<double, nano>(clk::now() - t0).count();
+
+    double n = double(max<size_t>(lines, 1));
+    cout << lines << " lines\n" << fixed << setprecision(1)
+         << "ostream + strftime    " << setw(7) << old_ns / n << " ns/line\n"
+         << "append_log_line       " << setw(7) << new_ns / n << " ns/line  (" << setprecision(2)
+         << old_ns / new_ns << "x)\n"
+         << "output " << (same ? "identical" : "DIFFERS") << "\n";
+    return same ? 0 : 1;
+}
 
-        if (!(is >> key) || key != "current_branch") { cout << "expected 'current_branch'\n"; return; }
-        if (!(is >> std::quoted(current_branch))) { cout << "bad current_branch\n"; return; }
-        getline(is, dummy);
+// Ingest throughput (--ingest-bench [MIB]): a generated text file of MIB
+// MiB, default 1024, is read into a string with an istream, then loaded the
+// way set-file does it, then committed. The file was just written, so every
+// read is served from the page cache.
+static int run_ingest_bench(size_t mib) {
+    string path = (filesystem::temp_directory_path() / ("ingest-bench-" + to_hex(Repo::now_ns()) + ".txt")).string();
+    {
+        string chunk;
+        mt19937_64 rng(3);
+        static const char* words[] = {"alpha", "beta", "gamma", "delta", "kappa", "omega", "sigma", "theta"};
+        while (chunk.size() < (size_t{1} << 20)) {
+            chunk += words[rng() % 8];
+            chunk += rng() % 8 ? ' ' : '\n';
+        }
+        chunk.resize(size_t{1} << 20);
+        ofstream os(path, ios::binary);
+        for (size_t i = 0; i < mib && os; ++i) os.write(chunk.data(), streamsize(chunk.size()));
+        if (!os) {
+            cout << "cannot write " << path << "\n";
+            error_code ec;
+            filesystem::remove(path, ec);
+            return 1;
+        }
+    }
 
-        int det = 0;
-        if (!(is >> key) || key != "detached") { cout << "expected 'detached'\n"; return; }
-        if (!(is >> det)) { cout << "bad detached\n"; return; }
-        detached = (det != 0);
-        getline(is, dummy);
+    using clk = chrono::steady_clock;
+    auto secs = [](clk::time_point t0) { return chrono::duration<double>(clk::now() - t0).count(); };
+    double mb = double(mib);
+
+    auto t0 = clk::now();
+    size_t read_size = 0;
+    {
+        ifstream in(path, ios::binary);
+        ostringstream buf;
+        buf << in.rdbuf();
+        read_size = buf.view().size();
+    }
+    double t_stream = secs(t0);
+
+    Repo repo;
+    t0 = clk::now();
+    Result<MappedFile> file = MappedFile::open(path);
+    bool ok = file.has_value();
+    if (ok) repo.set_working(file->view());
+    file = MappedFile();
+    double t_map = secs(t0);
+
+    t0 = clk::now();
+    if (ok) repo.commit("ingest");
+    double t_commit = secs(t0);
+    error_code ec;
+    filesystem::remove(path, ec);
+
+    ok = ok && read_size == repo.working_size() && repo.history.size() == 1;
+    cout << mib << " MiB\n" << fixed << setprecision(2)
+         << "istream read     " << setw(8) << t_stream << " s  " << setw(8) << setprecision(0) << mb / t_stream
+         << " MiB/s\n" << setprecision(2)
+         << "set-file (mmap)  " << setw(8) << t_map << " s  " << setw(8) << setprecision(0) << mb / t_map
+         << " MiB/s\n" << setprecision(2)
+         << "commit           " << setw(8) << t_commit << " s  " << setw(8) << setprecision(0) << mb / t_commit
+         << " MiB/s  (hash, trigram index, copy into history)\n";
+    if (!ok) cout << "ingest failed\n";
+    return ok ? 0 : 1;
+}
 
-        if (!(is >> key) || key != "head") { cout<<"expected 'head'\n"; return; }
-        if (!(is >> head)) { cout<<"bad head\n"; return; }
+#if defined(__linux__)
+// ---- server mode ----
+
+// Serves the command language on a Unix socket (--serve PATH). All clients
+// share one session: the same repository, working content and HEAD the REPL
+// would have. A single epoll thread does all socket I/O and hands complete
+// lines to worker threads. The repository is a SharedRepo: reads with a
+// snapshot handler never wait, other reads run in parallel under a shared
+// lock, and everything else runs under an exclusive one and publishes a new
+// snapshot. Each client's commands run one at a time, in the order it sent
+// them. A response is the command's output followed by a NUL byte.
+class Server {
+public:
+    Server(string path, unsigned workers) : path(std::move(path)), nworkers(max(1u, workers)) {}
+
+    int run() {
+        signal(SIGPIPE, SIG_IGN);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listen_fd < 0 || path.size() >= sizeof(addr.sun_path)) return fail("socket");
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) return fail("bind");
+        if (listen(listen_fd, SOMAXCONN) < 0) return fail("listen");
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);    // before the workers start: they inherit it
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        if (signal_fd < 0 || done_fd < 0 || ep < 0) return fail("epoll");
+        watch(listen_fd, kListen, EPOLLIN, EPOLL_CTL_ADD);
+        watch(done_fd, kDone, EPOLLIN, EPOLL_CTL_ADD);
+        watch(signal_fd, kSignal, EPOLLIN, EPOLL_CTL_ADD);
+
+        vector<thread> pool;
+        for (unsigned i = 0; i < nworkers; ++i) pool.emplace_back([this] { work(); });
+        cout << "serving on " << path << " with " << nworkers << " workers\n" << std::flush;
+
+        epoll_event evs[64];
+        bool stop = false;
+        while (!stop) {
+            int n = epoll_wait(ep, evs, 64, -1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { perror("epoll_wait"); break; }
+            for (int i = 0; i < n; ++i) {
+                uint64_t key = evs[i].data.u64;
+                if (key == kListen) accept_clients();
+                else if (key == kDone) finish_jobs();
+                else if (key == kSignal) stop = true;
+                else if (auto it = clients.find(key); it != clients.end()) on_client(key, it->second, evs[i].events);
+            }
+        }
 
-        if (head != 0) {
-            const Version* hv = get(head);
-            if (hv) working = hv->content;
-        } else {
-            working.clear();
+        {
+            lock_guard<mutex> lk(jobs_mu);
+            shutting_down = true;
         }
-        if (branches.empty()) branches["main"] = 0;
+        jobs_cv.notify_all();
+        for (auto& t : pool) t.join();
+        for (auto& [key, c] : clients) close(c.fd);
+        for (int fd : {listen_fd, signal_fd, done_fd, ep}) close(fd);
+        unlink(path.c_str());
+        return 0;
     }
-};
 
-static void help() {
-    cout <<
-         R"(Commands:
-  set "TEXT"              Replace working content
-  append "TEXT"           Append to working content
-  erase POS LEN           Erase [POS, POS+LEN)
-  commit "MSG"            Snapshot current working content (fails if no change)
+private:
+    static constexpr uint64_t kListen = 0, kDone = 1, kSignal = 2;
+    static constexpr size_t kMaxLine = size_t{1} << 20;
+    static constexpr size_t kMaxPayload = size_t{1} << 30;        // receive-pack <<N
+    static constexpr size_t kMaxPendingOut = size_t{4} << 20;   // stop running a client's commands past this
+
+    struct Request { string line, payload; };
+    struct Client {
+        int fd{-1};
+        string in, out;          // unparsed input, unsent output
+        deque<Request> queued;   // complete requests not yet handed to a worker
+        bool busy{false};        // one of its lines is on a worker
+        bool eof{false};         // peer has stopped sending; finish what it sent
+        bool closing{false};     // drop queued lines, close once flushed
+        uint32_t events{};       // current epoll interest
+    };
+    struct Job { uint64_t client; Request req; };
+    struct Done { uint64_t client; string output; bool keep; };
+
+    int fail(const char* what) {
+        perror(what);
+        return 1;
+    }
 
-  log [--all]             Show history for current branch (or all branches)
-  blog NAME               Show history for a specific branch
-  show ID                 Print content of version
-  checkout ID             Set working to version content (enter detached HEAD)
+    void watch(int fd, uint64_t key, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = key;
+        epoll_ctl(ep, op, fd, &ev);
+    }
 
-  branch NAME [AT_ID]     Create a new branch at HEAD or at AT_ID
-  branches                List branches
-  switch NAME             Switch to branch NAME (leave detached, if any)
-  delete-branch NAME      Delete a branch (not the current one)
-  status                  Show branch/HEAD state
+    void accept_clients() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            uint64_t key = next_key++;
+            Client& c = clients[key];
+            c.fd = fd;
+            c.events = EPOLLIN | EPOLLRDHUP;
+            watch(fd, key, c.events, EPOLL_CTL_ADD);
+        }
+    }
 
-  save FILE               Save repo (with branches) to file
-  load FILE               Load repo (with branches) from file
+    void on_client(uint64_t key, Client& c, uint32_t events) {
+        if (!c.eof && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            char buf[64 * 1024];
+            while (true) {
+                ssize_t r = read(c.fd, buf, sizeof(buf));
+                if (r > 0) { c.in.append(buf, size_t(r)); continue; }
+                if (r < 0 && errno == EINTR) continue;
+                if (r == 0) c.eof = true;
+                else if (errno != EAGAIN) c.closing = c.eof = true;
+                break;
+            }
+            // A line ending in "<<N" is only complete with the N bytes after it.
+            size_t start = 0, limit = kMaxLine;
+            for (size_t nl; (nl = c.in.find('\n', start)) != string::npos;) {
+                string line = c.in.substr(start, nl - start);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                size_t need = payload_size(line).value_or(0);
+                if (need > kMaxPayload) { limit = 0; break; }
+                if (c.in.size() - (nl + 1) < need) {
+                    limit = nl + 1 - start + need;
+                    break;
+                }
+                c.queued.push_back({std::move(line), c.in.substr(nl + 1, need)});
+                start = nl + 1 + need;
+            }
+            c.in.erase(0, start);
+            if (c.in.size() > limit) {
+                c.in.clear();
+                c.out += limit ? "line too long" : "payload too large";
+                c.out += '\0';
+                c.closing = c.eof = true;
+            }
+        }
+        flush(key, c);
+    }
 
-  print                   Print working content
-  help                    Show this help
-  exit                    Quit
-)";
-}
+    // Sends what it can, hands the next line to a worker, and closes the
+    // client once it has nothing left to do.
+    void flush(uint64_t key, Client& c) {
+        while (!c.out.empty()) {
+            ssize_t w = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && errno == EAGAIN) break;
+            if (w < 0) { c.out.clear(); c.closing = c.eof = true; break; }
+            c.out.erase(0, size_t(w));
+        }
+        if (c.closing) c.queued.clear();
+        while (!c.busy && !c.queued.empty() && c.out.size() < kMaxPendingOut) {
+            Request req = std::move(c.queued.front());
+            c.queued.pop_front();
+            if (req.line.find_first_not_of(" \t") == string::npos) continue;
+            c.busy = true;
+            {
+                lock_guard<mutex> lk(jobs_mu);
+                jobs.push_back({key, std::move(req)});
+            }
+            jobs_cv.notify_one();
+        }
+        if (c.eof && !c.busy && c.queued.empty() && c.out.empty()) {
+            close(c.fd);
+            clients.erase(key);
+            return;
+        }
+        uint32_t want = (c.eof ? 0u : uint32_t(EPOLLIN | EPOLLRDHUP)) | (c.out.empty() ? 0u : uint32_t(EPOLLOUT));
+        if (want != c.events) {
+            // deregister while idle: a hung-up socket would otherwise keep reporting EPOLLHUP
+            watch(c.fd, key, want, !c.events ? EPOLL_CTL_ADD : !want ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+            c.events = want;
+        }
+    }
 
-int main() {
-    Repo repo;
-    help();
-    string line;
-    while (true) {
-        cout << "> " << flush;
-        if (!std::getline(cin, line)) {
-            if (cin.eof() || cin.bad()) break;
-            cin.clear();
-            continue;
+    void finish_jobs() {
+        uint64_t count;
+        while (read(done_fd, &count, sizeof(count)) > 0) {}
+        vector<Done> batch;
+        {
+            lock_guard<mutex> lk(done_mu);
+            batch.swap(done);
         }
-        if (line.find_first_not_of(" \t\r\n") == string::npos) continue;
-        std::istringstream in(line);
-        string cmd;
-        if (!(in >> cmd)) continue;
+        for (Done& d : batch) {
+            auto it = clients.find(d.client);
+            if (it == clients.end()) continue;
+            Client& c = it->second;
+            c.busy = false;
+            c.out += d.output;
+            c.out += '\0';
+            if (!d.keep) c.closing = c.eof = true;
+            flush(d.client, c);
+        }
+    }
 
-        try {
-            if (cmd == "set") {
-                string rest;
-                std::getline(in, rest);
-                auto pos = rest.find_first_not_of(' ');
-                string s = (pos==string::npos) ? string() : rest.substr(pos);
-                if (!s.empty() && s.front()=='"' && s.back()=='"' && s.size()>=2)
-                    s = s.substr(1, s.size()-2);
-                repo.working = std::move(s);
-
-            } else if (cmd == "append") {
-                string rest; std::getline(in, rest);
-                auto pos = rest.find_first_not_of(' ');
-                string s = (pos==string::npos) ? string() : rest.substr(pos);
-                if (!s.empty() && s.front()=='"' && s.back()=='"' && s.size()>=2)
-                    s = s.substr(1, s.size()-2);
-                repo.working += s;
-
-            } else if (cmd == "erase") {
-                string pTok, lenTok;
-                if (!(in >> pTok >> lenTok)) { cout << "usage: erase POS LEN\n"; continue; }
-                size_t p=0, len=0;
-                try {
-                    p = stoull(pTok);
-                    len = stoull(lenTok);
-                } catch (...) { cout << "erase: POS and LEN must be numbers\n"; continue; }
-                if (p > repo.working.size()) { cout << "pos out of range\n"; continue; }
-                size_t take = min(len, repo.working.size()-p);
-                repo.working.erase(p, take);
-
-            } else if (cmd == "commit") {
-                string rest; std::getline(in, rest);
-                auto pos = rest.find_first_not_of(' ');
-                string msg = (pos==string::npos) ? string() : rest.substr(pos);
-                if (!msg.empty() && msg.front()=='"' && msg.back()=='"' && msg.size()>=2)
-                    msg = msg.substr(1, msg.size()-2);
-                auto id = repo.commit(std::move(msg));
-                cout << "Committed as " << id << (repo.detached ? " (detached)\n" : (" on branch " + repo.current_branch + "\n"));
-
-            } else if (cmd == "log") {
-                string opt;
-                if (in >> opt && opt == "--all") {
-                    for (const auto& kv : repo.branches) {
-                        const string& nm = kv.first;
-                        VersionId hid = kv.second;
-                        auto ids = repo.chain_from(hid);
-                        repo.print_chain(ids, "branch " + nm, hid);
+    // Worker threads: run a line against the shared repo with output captured.
+    void work() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lk(jobs_mu);
+                jobs_cv.wait(lk, [&] { return shutting_down || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            ostringstream buf;
+            out_stream = &buf;
+            bool keep = true;
+            try {
+                TextCursor args{job.req.line};
+                string_view name;
+                args.word(name);
+                const Command* cmd = find_command(name);
+                if (cmd && (cmd->read || cmd->write == cmd_load)) {
+#if VCS_STATS
+                    CommandTimer timer(*cmd);
+#endif
+                    TextCursor snap_args = args;
+                    if (cmd->snap && cmd->snap(*shared.read(), snap_args)) {
+                        // answered from the current snapshot
+                    } else if (cmd->read) {
+                        shared.inspect([&](const Repo& r) { cmd->read(r, args); });
+                    } else {
+                        // snapshots point into the history load would replace; swap in a new Repo instead
+                        string_view file;
+                        if (!args.word(file)) usage("load FILE");
+                        else if (report_load(shared.load(string(file)))) out() << "Loaded from " << file << "\n";
                     }
                 } else {
-                    bool det = repo.detached;
-                    VersionId tip = det ? repo.head : repo.branches.at(repo.current_branch);
-                    auto ids = repo.chain_from(tip);
-                    string label = det ? "(detached)" : ("branch " + repo.current_branch);
-                    repo.print_chain(ids, label, tip);
+                    keep = shared.write([&](Repo& r) { return run_command(r, job.req.line, job.req.payload); }) !=
+                           CmdStatus::exit;
                 }
+            } catch (const exception& e) {
+                out() << "Error: " << e.what() << "\n";
+            }
+            out_stream = &cout;
+            {
+                lock_guard<mutex> lk(done_mu);
+                done.push_back({job.client, std::move(buf).str(), keep});
+            }
+            uint64_t one = 1;
+            ssize_t r = write(done_fd, &one, sizeof(one));
+            (void)r;
+        }
+    }
 
-            } else if (cmd == "blog") {
-                string name;
-                if (!(in >> name)) { cout << "usage: blog NAME\n"; continue; }
-                auto it = repo.branches.find(name);
-                if (it == repo.branches.end()) { cout << "no such branch\n"; continue; }
-                auto ids = repo.chain_from(it->second);
-                repo.print_chain(ids, "branch " + name, it->second);
-
-            } else if (cmd == "show") {
-                string idTok;
-                if (!(in >> idTok)) { cout << "usage: show ID\n"; continue; }
-                VersionId id{};
-                try { id = stoull(idTok); }
-                catch (...) { cout << "invalid ID\n"; continue; }
-                auto* v = repo.get(id);
-                if (!v) { cout << "No such version\n"; continue; }
-                cout << v->content << "\n";
-
-            } else if (cmd == "checkout") {
-                string idTok;
-                if (!(in >> idTok)) { cout << "usage: checkout ID\n"; continue; }
-                VersionId id{};
-                try { id = stoull(idTok); }
-                catch (...) { cout << "invalid ID\n"; continue; }
-                repo.checkout_version(id);
-                cout << "Checked out " << id << " (detached)\n";
-
-            } else if (cmd == "branch") {
-                string name; string atTok;
-                if (!(in >> name)) { cout << "usage: branch NAME [AT_ID]\n"; continue; }
-                VersionId at = repo.head;
-                if (in >> atTok) {
-                    try { at = stoull(atTok); }
-                    catch (...) { cout << "invalid AT_ID\n"; continue; }
-                }
-                repo.create_branch(name, at);
+    string path;
+    unsigned nworkers;
+    int listen_fd{-1}, signal_fd{-1}, done_fd{-1}, ep{-1};
 
-            } else if (cmd == "branches") {
-                repo.list_branches();
+    unordered_map<uint64_t, Client> clients;    // event-loop thread only
+    uint64_t next_key{3};
 
-            } else if (cmd == "switch") {
-                string name;
-                if (!(in >> name)) { cout << "usage: switch NAME\n"; continue; }
-                if (repo.switch_branch(name)) {
-                    cout << "Switched to branch " << name << "\n";
-                }
+    SharedRepo shared;
 
-            } else if (cmd == "delete-branch") {
-                string name;
-                if (!(in >> name)) { cout << "usage: delete-branch NAME\n"; continue; }
-                repo.delete_branch(name);
+    mutex jobs_mu;
+    condition_variable jobs_cv;
+    deque<Job> jobs;
+    bool shutting_down{false};
 
-            } else if (cmd == "status") {
-                repo.status();
+    mutex done_mu;
+    vector<Done> done;
+};
 
-            } else if (cmd == "save") {
-                string file;
-                if (!(in >> file)) { cout << "usage: save FILE\n"; continue; }
-                repo.save(file);
-                cout << "Saved to " << file << "\n";
+// Load generator for --serve (--load PATH [CLIENTS] [RATE] [SECONDS]). Each
+// client connection sends on a fixed schedule, together totalling RATE
+// requests/s: mostly reads, with one write in ten. Latency is measured from
+// the scheduled send time, so a slow server cannot hide queueing delay by
+// holding back the next request.
+static int run_load(const string& path, unsigned nclients, double rate, double seconds) {
+    auto connect_to = [&]() -> int {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (fd < 0 || path.size() >= sizeof(addr.sun_path)) return -1;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) { close(fd); return -1; }
+        return fd;
+    };
+    // One request/response round trip; false if the connection broke.
+    auto request = [](int fd, const string& line, string& pending) {
+        string msg = line + "\n";
+        for (size_t off = 0; off < msg.size(); ) {
+            ssize_t w = send(fd, msg.data() + off, msg.size() - off, MSG_NOSIGNAL);
+            if (w <= 0) return false;
+            off += size_t(w);
+        }
+        while (true) {
+            if (auto z = pending.find('\0'); z != string::npos) {
+                pending.erase(0, z + 1);
+                return true;
+            }
+            char buf[16 * 1024];
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r <= 0) return false;
+            pending.append(buf, size_t(r));
+        }
+    };
+
+    {
+        int fd = connect_to();
+        string pending;
+        if (fd < 0 || !request(fd, "set \"seed\"", pending) || !request(fd, "commit \"seed\"", pending)) {
+            cout << "cannot reach server at " << path << "\n";
+            if (fd >= 0) close(fd);
+            return 1;
+        }
+        close(fd);
+    }
 
-            } else if (cmd == "load") {
-                string file;
-                if (!(in >> file)) { cout << "usage: load FILE\n"; continue; }
-                repo.load(file);
-                cout << "Loaded from " << file << "\n";
+    using clk = chrono::steady_clock;
+    nclients = max(1u, nclients);
+    auto interval = chrono::duration_cast<clk::duration>(chrono::duration<double>(nclients / rate));
+    auto begin = clk::now() + chrono::milliseconds(50);
+    auto finish = begin + chrono::duration_cast<clk::duration>(chrono::duration<double>(seconds));
+    vector<vector<uint32_t>> lat(nclients);      // microseconds
+    atomic<unsigned> broken{0};
+    vector<thread> pool;
+    for (unsigned t = 0; t < nclients; ++t) {
+        pool.emplace_back([&, t] {
+            int fd = connect_to();
+            if (fd < 0) { broken.fetch_add(1); return; }
+            static const char* reads[] = {"status", "show 1", "branches", "log --limit 5", "print"};
+            string pending;
+            auto due = begin + interval * t / nclients;
+            for (uint64_t k = 0; due < finish; ++k, due += interval) {
+                this_thread::sleep_until(due);
+                string line = k % 10 == 9 ? (k % 20 == 19 ? "commit \"load\"" : "append \"" + to_string(t) + "\"")
+                                          : reads[k % 5];
+                if (!request(fd, line, pending)) { broken.fetch_add(1); break; }
+                lat[t].push_back(uint32_t(chrono::duration_cast<chrono::microseconds>(clk::now() - due).count()));
+            }
+            close(fd);
+        });
+    }
+    for (auto& th : pool) th.join();
+
+    vector<uint32_t> all;
+    for (auto& v : lat) all.insert(all.end(), v.begin(), v.end());
+    if (all.empty()) { cout << "no requests completed\n"; return 1; }
+    sort(all.begin(), all.end());
+    auto pct = [&](double q) { return all[min(all.size() - 1, size_t(q * all.size()))]; };
+    cout << "requests " << all.size() << " in " << seconds << " s (" << fixed << setprecision(0)
+         << all.size() / seconds << "/s target " << rate << "/s, " << nclients << " clients)\n";
+    cout << "latency us: p50 " << pct(0.50) << "  p99 " << pct(0.99) << "  p99.9 " << pct(0.999)
+         << "  max " << all.back() << "\n";
+    if (broken) cout << broken.load() << " connections failed\n";
+    return broken ? 1 : 0;
+}
+#endif
 
-            } else if (cmd == "print") {
-                cout << repo.working << "\n";
+int main(int argc, char** argv) {
+    // --threads N may appear anywhere; it sizes the task pool and the server's workers.
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        if (string_view(argv[i]) != "--threads") continue;
+        try {
+            if (i + 1 >= argc) throw invalid_argument("--threads");
+            threads = unsigned(max(1, stoi(argv[i + 1])));
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --threads N ...\n";
+            return 2;
+        }
+        copy(argv + i + 2, argv + argc, argv + i);
+        argc -= 2;
+        --i;
+    }
+    set_task_threads(threads);
 
-            } else if (cmd == "help") {
-                help();
+    if (argc >= 2 && string_view(argv[1]) == "--pool-bench") {
+        size_t versions = 20000;
+        try {
+            if (argc >= 3) threads = unsigned(max(1, stoi(argv[2])));
+            if (argc >= 4) versions = stoull(argv[3]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --pool-bench [MAX_THREADS] [VERSIONS]\n";
+            return 2;
+        }
+        return run_pool_bench(threads, versions);
+    }
+    if (argc >= 2 && string_view(argv[1]) == "--dispatch-bench") {
+        size_t lines = 2000000;
+        try {
+            if (argc >= 3) lines = stoull(argv[2]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --dispatch-bench [LINES]\n";
+            return 2;
+        }
+        return run_dispatch_bench(lines);
+    }
+    if (argc >= 2 && string_view(argv[1]) == "--format-bench") {
+        size_t lines = 1000000;
+        try {
+            if (argc >= 3) lines = stoull(argv[2]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --format-bench [LINES]\n";
+            return 2;
+        }
+        return run_format_bench(lines);
+    }
+    if (argc >= 2 && string_view(argv[1]) == "--ingest-bench") {
+        size_t mib = 1024;
+        try {
+            if (argc >= 3) mib = stoull(argv[2]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --ingest-bench [MIB]\n";
+            return 2;
+        }
+        return run_ingest_bench(mib);
+    }
+    if (argc >= 2 && string_view(argv[1]) == "--mvcc-bench") {
+        unsigned readers = max(1u, thread::hardware_concurrency());
+        double seconds = 1.0;
+        try {
+            if (argc >= 3) readers = max(1, stoi(argv[2]));
+            if (argc >= 4) seconds = stod(argv[3]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --mvcc-bench [MAX_READERS] [SECONDS]\n";
+            return 2;
+        }
+        return run_mvcc_bench(readers, seconds);
+    }
+#if defined(__linux__)
+    if (argc == 3 && string_view(argv[1]) == "--serve")
+        return Server(argv[2], threads).run();
+    if (argc >= 3 && string_view(argv[1]) == "--load") {
+        unsigned clients = 16;
+        double rate = 10000, seconds = 5;
+        try {
+            if (argc >= 4) clients = max(1, stoi(argv[3]));
+            if (argc >= 5) rate = stod(argv[4]);
+            if (argc >= 6) seconds = stod(argv[5]);
+        } catch (...) {
+            cout << "usage: " << argv[0] << " --load PATH [CLIENTS] [RATE] [SECONDS]\n";
+            return 2;
+        }
+        return run_load(argv[2], clients, rate, seconds);
+    }
+#endif
 
-            } else if (cmd == "exit" || cmd == "quit") {
-                break;
+    bool batch = false, exit_on_error = false, stdio = false;
+    string script, stdio_file;
+    for (int i = 1; i < argc; ++i) {
+        string_view a = argv[i];
+        if (a == "--batch") {
+            batch = true;
+        } else if (a == "--exit-on-error") {
+            exit_on_error = true;
+        } else if (a == "--stdio") {
+            stdio = batch = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') stdio_file = argv[++i];
+        } else if (a == "-f" && i + 1 < argc) {
+            script = argv[++i];
+        } else {
+            cout << "usage: " << argv[0] << " [--threads N] [--batch | --stdio [FILE]] [-f SCRIPT] [--exit-on-error]\n"
+                 << "       " << argv[0] << " --serve PATH | --load PATH [CLIENTS] [RATE] [SECONDS]\n"
+                 << "       " << argv[0] << " --mvcc-bench [MAX_READERS] [SECONDS]\n"
+                 << "       " << argv[0] << " --pool-bench [MAX_THREADS] [VERSIONS]\n"
+                 << "       " << argv[0] << " --dispatch-bench [LINES]\n"
+                 << "       " << argv[0] << " --format-bench [LINES]\n"
+                 << "       " << argv[0] << " --ingest-bench [MIB]\n";
+            return 2;
+        }
+    }
+    ifstream file;
+    if (!script.empty()) {
+        file.open(script);
+        if (!file) { cerr << "cannot open " << script << "\n"; return 2; }
+        batch = true;
+    }
+#if __has_include(<unistd.h>)
+    if (!isatty(STDIN_FILENO)) batch = true;
+#endif
+    // Batch mode: no banner or prompts, and block-buffered output that is not
+    // synchronized with stdio. --stdio is batch mode for a push/pull peer: each
+    // response ends in a NUL byte and is flushed, as the server does. Its FILE
+    // is loaded first, if it exists, and saved again if a push changed it.
+    static char obuf[1 << 20];
+    if (batch) {
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        cout.rdbuf()->pubsetbuf(obuf, sizeof(obuf));
+    }
+    istream& src = script.empty() ? cin : file;
 
-            } else {
-                cout << "Unknown command. Type 'help'.\n";
-            }
-        } catch (const exception& e) {
-            cout << "Error: " << e.what() << "\n";
+    Repo repo;
+    if (!stdio_file.empty() && filesystem::exists(stdio_file) && !load_repo(repo, stdio_file)) {
+        cout << flush;
+        return 1;
+    }
+    bool pushed = false;
+    if (!batch) help();
+    string line;
+    size_t lineno = 0;
+    while (true) {
+        if (!batch) cout << "> " << flush;
+        if (!std::getline(src, line)) {
+            if (src.eof() || src.bad()) break;
+            src.clear();
+            continue;
+        }
+        ++lineno;
+        if (line.find_first_not_of(" \t\r\n") == string::npos) continue;
+        string payload;
+        if (optional<size_t> n = payload_size(line)) {
+            payload.resize(*n);
+            src.read(payload.data(), streamsize(*n));
+            payload.resize(size_t(src.gcount()));
+        }
+        CmdStatus st = run_command(repo, line, payload);
+        pushed |= st == CmdStatus::ok && line.starts_with("receive-pack");
+        if (stdio) cout << '\0' << flush;
+        if (st == CmdStatus::exit) break;
+        if (st == CmdStatus::error && exit_on_error) {
+            cout << flush;
+            cerr << (script.empty() ? "<stdin>" : script) << ":" << lineno << ": failed: " << line << "\n";
+            return 1;
         }
     }
+    if (pushed && !stdio_file.empty() && !check(repo.save(stdio_file))) {
+        cout << flush;
+        return 1;
+    }
     return 0;
 }
+
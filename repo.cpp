@@ -0,0 +1,1742 @@
+#include "repo.h"
+
+#include <bits/stdc++.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace vcs {
+
+string fmt_time_local(int64_t ts_ns) {
+    string s;
+    append_time_local(s, ts_ns);
+    return s;
+}
+
+optional<int64_t> parse_time_ns(const string& s) {
+    if (!s.empty() && all_of(s.begin(), s.end(), [](unsigned char c) { return isdigit(c); })) {
+        try { return static_cast<int64_t>(stoll(s)) * 1000000000LL; }
+        catch (...) { return nullopt; }
+    }
+    for (const char* f : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"}) {
+        tm t{};
+        istringstream in(s);
+        in >> get_time(&t, f);
+        if (in.fail() || in.peek() != EOF) continue;
+        t.tm_isdst = -1;
+        time_t secs = mktime(&t);
+        if (secs == time_t(-1)) return nullopt;
+        return static_cast<int64_t>(secs) * 1000000000LL;
+    }
+    return nullopt;
+}
+
+uint64_t hash64(string_view s) {
+    constexpr uint64_t FNV_OFFSET = 1469598103934665603ULL;
+    constexpr uint64_t FNV_PRIME  = 1099511628211ULL;
+    uint64_t h = FNV_OFFSET;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+string to_hex(uint64_t x) {
+    string s;
+    append_hex(s, x);
+    return s;
+}
+
+// ---- formatting ----
+
+// "00".."ff" and "00".."99", two characters per entry.
+static constexpr auto kHexPairs = [] {
+    array<char, 512> t{};
+    for (size_t i = 0; i < 256; ++i) {
+        t[2 * i] = "0123456789abcdef"[i >> 4];
+        t[2 * i + 1] = "0123456789abcdef"[i & 15];
+    }
+    return t;
+}();
+
+static constexpr auto kDecPairs = [] {
+    array<char, 200> t{};
+    for (size_t i = 0; i < 100; ++i) {
+        t[2 * i] = char('0' + i / 10);
+        t[2 * i + 1] = char('0' + i % 10);
+    }
+    return t;
+}();
+
+void append_hex(string& out, uint64_t x) {
+    char buf[16];
+    for (int i = 7; i >= 0; --i, x >>= 8) memcpy(buf + 2 * i, &kHexPairs[2 * (x & 0xff)], 2);
+    out.append(buf, sizeof(buf));
+}
+
+void append_number(string& out, uint64_t x) {
+    char buf[20];
+    char* end = to_chars(buf, buf + sizeof(buf), x).ptr;
+    out.append(buf, end);
+}
+
+static bool local_tm(time_t secs, tm& out) {
+#if defined(_WIN32)
+    return localtime_s(&out, &secs) == 0;
+#else
+    return localtime_r(&secs, &out) != nullptr;
+#endif
+}
+
+// Local time minus UTC at `secs`, in seconds.
+static optional<int64_t> utc_offset(time_t secs) {
+    tm t{};
+    if (!local_tm(secs, t)) return nullopt;
+    chrono::sys_days d = chrono::year_month_day(chrono::year(t.tm_year + 1900), chrono::month(unsigned(t.tm_mon + 1)),
+                                                chrono::day(unsigned(t.tm_mday)));
+    int64_t local = int64_t(d.time_since_epoch().count()) * 86400 + t.tm_hour * 3600 + t.tm_min * 60 + t.tm_sec;
+    return local - int64_t(secs);
+}
+
+// A UTC day and the offset in force all through it. Days with an offset
+// change (a DST switch, a leap second) are marked and take the slow path.
+struct TzDay {
+    int64_t day{INT64_MIN};
+    int64_t offset{};
+    bool    uniform{};
+};
+
+void append_time_local(string& out, int64_t ts_ns) {
+    time_t secs = (time_t)(ts_ns / 1000000000LL);
+    int64_t day = int64_t(secs) / 86400 - (int64_t(secs) % 86400 < 0);
+
+    static thread_local array<TzDay, 256> cache;
+    TzDay& c = cache[size_t(day) % cache.size()];
+    if (c.day != day) {
+        optional<int64_t> a = utc_offset(time_t(day * 86400)), b = utc_offset(time_t(day * 86400 + 86399));
+        c = {day, a.value_or(0), a && b && *a == *b};
+    }
+    if (c.uniform) {
+        int64_t local = int64_t(secs) + c.offset;
+        int64_t ldays = local / 86400 - (local % 86400 < 0);
+        int64_t sod = local - ldays * 86400;
+        chrono::year_month_day ymd{chrono::sys_days(chrono::days(ldays))};
+        int y = int(ymd.year());
+        if (y >= 1000 && y <= 9999) {
+            char buf[19];
+            auto put2 = [&](char* p, unsigned v) { memcpy(p, &kDecPairs[2 * v], 2); };
+            put2(buf, unsigned(y / 100));
+            put2(buf + 2, unsigned(y % 100));
+            buf[4] = '-';
+            put2(buf + 5, unsigned(ymd.month()));
+            buf[7] = '-';
+            put2(buf + 8, unsigned(ymd.day()));
+            buf[10] = ' ';
+            put2(buf + 11, unsigned(sod / 3600));
+            buf[13] = ':';
+            put2(buf + 14, unsigned(sod / 60 % 60));
+            buf[16] = ':';
+            put2(buf + 17, unsigned(sod % 60));
+            out.append(buf, sizeof(buf));
+            return;
+        }
+    }
+
+    tm tmout{};
+    char buf[32];
+    if (!local_tm(secs, tmout) || std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmout) == 0) {
+        out += "invalid-time";
+        return;
+    }
+    out += buf;
+}
+
+static unique_ptr<TaskPool>& task_pool_slot() {
+    static unique_ptr<TaskPool> pool;
+    return pool;
+}
+
+TaskPool& task_pool() {
+    auto& pool = task_pool_slot();
+    if (!pool) pool = make_unique<TaskPool>(max(1u, thread::hardware_concurrency()));
+    return *pool;
+}
+
+void set_task_threads(unsigned n) {
+    task_pool_slot() = make_unique<TaskPool>(max(1u, n));
+}
+
+// ---- latency statistics ----
+
+LatencyHistogram::Summary LatencyHistogram::summary() const {
+    array<uint64_t, kBuckets> c;
+    Summary s;
+    for (size_t i = 0; i < kBuckets; ++i) s.count += c[i] = counts[i].load(memory_order_relaxed);
+    s.max = max_ns.load(memory_order_relaxed);
+    s.estimated = sampled.load(memory_order_relaxed);
+    if (s.count == 0) return s;
+
+    // smallest bucket holding the ceil(q * count)-th sample
+    auto at = [&](double q) {
+        uint64_t rank = max<uint64_t>(1, uint64_t(ceil(q * double(s.count)))), seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i)
+            if ((seen += c[i]) >= rank) return min(bucket_high(i), s.max);
+        return s.max;
+    };
+    s.p50 = at(0.50);
+    s.p90 = at(0.90);
+    s.p99 = at(0.99);
+    return s;
+}
+
+void LatencyHistogram::reset() {
+    for (auto& c : counts) c.store(0, memory_order_relaxed);
+    max_ns.store(0, memory_order_relaxed);
+    sampled.store(false, memory_order_relaxed);
+}
+
+struct LatencyRegistry {
+    mutex mu;
+    deque<LatencyHistogram> all;    // never moves an element
+};
+
+static LatencyRegistry& latency_registry() {
+    static LatencyRegistry r;
+    return r;
+}
+
+LatencyHistogram& latency_histogram(string_view name) {
+    LatencyRegistry& r = latency_registry();
+    lock_guard<mutex> lk(r.mu);
+    for (LatencyHistogram& h : r.all)
+        if (h.name() == name) return h;
+    return r.all.emplace_back(string(name));
+}
+
+vector<const LatencyHistogram*> latency_histograms() {
+    LatencyRegistry& r = latency_registry();
+    lock_guard<mutex> lk(r.mu);
+    vector<const LatencyHistogram*> out;
+    for (const LatencyHistogram& h : r.all) out.push_back(&h);
+    return out;
+}
+
+void reset_latency_histograms() {
+    LatencyRegistry& r = latency_registry();
+    lock_guard<mutex> lk(r.mu);
+    for (LatencyHistogram& h : r.all) h.reset();
+}
+
+// ---- line diff ----
+
+static size_t common_prefix_len(string_view a, string_view b) {
+    size_t n = min(a.size(), b.size()), i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.data() + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b.data() + i));
+        unsigned eq = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+        if (eq != 0xFFFFu) return i + std::countr_zero(~eq);
+    }
+#endif
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+static size_t common_suffix_len(string_view a, string_view b) {
+    size_t n = min(a.size(), b.size()), i = 0;
+    const char* ae = a.data() + a.size();
+    const char* be = b.data() + b.size();
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ae - i - 16));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(be - i - 16));
+        unsigned ne = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFFu;
+        if (ne) return i + (std::countl_zero(ne) - 16);
+    }
+#endif
+    while (i < n && ae[-1 - (ptrdiff_t)i] == be[-1 - (ptrdiff_t)i]) ++i;
+    return i;
+}
+
+vector<string_view> split_lines(string_view s) {
+    vector<string_view> out;
+    size_t start = 0;
+    while (start < s.size()) {
+        size_t nl = s.find('\n', start);
+        size_t end = (nl == string_view::npos) ? s.size() : nl + 1;
+        out.push_back(s.substr(start, end - start));
+        start = end;
+    }
+    return out;
+}
+
+// Histogram diff (as in git/jgit) over interned line ids, falling back to a
+// linear-space Myers O(ND) search for regions made only of frequent lines.
+class DiffEngine {
+public:
+    DiffEngine(vector<uint32_t> a, vector<uint32_t> b) : A(std::move(a)), B(std::move(b)) {}
+
+    // Runs of equal lines, in order, as (a, b, len).
+    vector<array<size_t, 3>> run() {
+        histogram(0, A.size(), 0, B.size());
+        return std::move(matches);
+    }
+
+private:
+    static constexpr uint32_t kMaxChain = 64;
+    static constexpr size_t   kMinCost  = 256;
+    static constexpr size_t   kNone     = SIZE_MAX;
+
+    vector<uint32_t> A, B;
+    vector<array<size_t, 3>> matches;
+    vector<ptrdiff_t> vf, vb;
+
+    void emit(size_t a, size_t b, size_t len) {
+        if (len == 0) return;
+        if (!matches.empty()) {
+            auto& m = matches.back();
+            if (m[0] + m[2] == a && m[1] + m[2] == b) { m[2] += len; return; }
+        }
+        matches.push_back({a, b, len});
+    }
+
+    void histogram(size_t a0, size_t a1, size_t b0, size_t b1) {
+        size_t pre = 0;
+        while (a0 + pre < a1 && b0 + pre < b1 && A[a0 + pre] == B[b0 + pre]) ++pre;
+        emit(a0, b0, pre);
+        a0 += pre; b0 += pre;
+        size_t suf = 0;
+        while (a1 - suf > a0 && b1 - suf > b0 && A[a1 - suf - 1] == B[b1 - suf - 1]) ++suf;
+        a1 -= suf; b1 -= suf;
+        if (a0 < a1 && b0 < b1) {
+            auto [ma, mb, len] = anchor(a0, a1, b0, b1);
+            if (len == 0) {
+                myers(a0, a1, b0, b1);
+            } else {
+                histogram(a0, ma, b0, mb);
+                emit(ma, mb, len);
+                histogram(ma + len, a1, mb + len, b1);
+            }
+        }
+        emit(a1, b1, suf);
+    }
+
+    // Longest common run around the rarest line of A that also occurs in B.
+    array<size_t, 3> anchor(size_t a0, size_t a1, size_t b0, size_t b1) const {
+        struct Rec { uint32_t count; size_t last; };
+        unordered_map<uint32_t, Rec> recs;
+        recs.reserve(a1 - a0);
+        vector<size_t> prev(a1 - a0);
+        for (size_t i = a0; i < a1; ++i) {
+            auto it = recs.try_emplace(A[i], Rec{0, kNone}).first;
+            prev[i - a0] = it->second.last;
+            it->second.count++;
+            it->second.last = i;
+        }
+
+        uint32_t best_cnt = kMaxChain + 1;
+        array<size_t, 3> best{0, 0, 0};
+        for (size_t j = b0; j < b1; ) {
+            size_t next_j = j + 1;
+            auto it = recs.find(B[j]);
+            if (it != recs.end() && it->second.count <= best_cnt) {
+                for (size_t i = it->second.last; i != kNone; i = prev[i - a0]) {
+                    size_t sa = i, sb = j;
+                    while (sa > a0 && sb > b0 && A[sa - 1] == B[sb - 1]) { --sa; --sb; }
+                    size_t ea = i + 1, eb = j + 1;
+                    while (ea < a1 && eb < b1 && A[ea] == B[eb]) { ++ea; ++eb; }
+                    if (it->second.count < best_cnt || ea - sa > best[2]) {
+                        best_cnt = it->second.count;
+                        best = {sa, sb, ea - sa};
+                    }
+                    next_j = max(next_j, eb);
+                }
+            }
+            j = next_j;
+        }
+        return best;
+    }
+
+    void myers(size_t a0, size_t a1, size_t b0, size_t b1) {
+        size_t pre = 0;
+        while (a0 + pre < a1 && b0 + pre < b1 && A[a0 + pre] == B[b0 + pre]) ++pre;
+        emit(a0, b0, pre);
+        a0 += pre; b0 += pre;
+        size_t suf = 0;
+        while (a1 - suf > a0 && b1 - suf > b0 && A[a1 - suf - 1] == B[b1 - suf - 1]) ++suf;
+        a1 -= suf; b1 -= suf;
+        if (a0 < a1 && b0 < b1) {
+            auto [x, y] = bisect(a0, a1, b0, b1);
+            myers(a0, x, b0, y);
+            myers(x, a1, y, b1);
+        }
+        emit(a1, b1, suf);
+    }
+
+    // Finds a point on a shortest edit path by running the forward and reverse
+    // searches until they overlap.  Past ~sqrt(N+M) edits it gives up on
+    // optimality and splits at the furthest-reaching forward point.
+    pair<size_t, size_t> bisect(size_t a0, size_t a1, size_t b0, size_t b1) {
+        const ptrdiff_t N = a1 - a0, M = b1 - b0, delta = N - M;
+        const ptrdiff_t max_cost = max<ptrdiff_t>(kMinCost, static_cast<ptrdiff_t>(sqrt(double(N + M))));
+        const ptrdiff_t max_d = min((N + M + 1) / 2, max_cost + 1), off = max_d, len = 2 * max_d + 2;
+        const bool front = delta & 1;
+        vf.assign(len, -1);
+        vb.assign(len, -1);
+        vf[off + 1] = 0;
+        vb[off + 1] = 0;
+        ptrdiff_t k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+        ptrdiff_t best_x = 0, best_y = 0;
+
+        for (ptrdiff_t d = 0; d < max_d; ++d) {
+            for (ptrdiff_t k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+                ptrdiff_t i1 = off + k1;
+                ptrdiff_t x1 = (k1 == -d || (k1 != d && vf[i1 - 1] < vf[i1 + 1])) ? vf[i1 + 1] : vf[i1 - 1] + 1;
+                ptrdiff_t y1 = x1 - k1;
+                while (x1 < N && y1 < M && A[a0 + x1] == B[b0 + y1]) { ++x1; ++y1; }
+                vf[i1] = x1;
+                if (x1 > N) {
+                    k1end += 2;
+                } else if (y1 > M) {
+                    k1start += 2;
+                } else {
+                    if (x1 + y1 > best_x + best_y) { best_x = x1; best_y = y1; }
+                    if (front) {
+                        ptrdiff_t i2 = off + delta - k1;
+                        if (i2 >= 0 && i2 < len && vb[i2] != -1 && x1 >= N - vb[i2])
+                            return {a0 + x1, b0 + y1};
+                    }
+                }
+            }
+            for (ptrdiff_t k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+                ptrdiff_t i2 = off + k2;
+                ptrdiff_t x2 = (k2 == -d || (k2 != d && vb[i2 - 1] < vb[i2 + 1])) ? vb[i2 + 1] : vb[i2 - 1] + 1;
+                ptrdiff_t y2 = x2 - k2;
+                while (x2 < N && y2 < M && A[a1 - 1 - x2] == B[b1 - 1 - y2]) { ++x2; ++y2; }
+                vb[i2] = x2;
+                if (x2 > N) {
+                    k2end += 2;
+                } else if (y2 > M) {
+                    k2start += 2;
+                } else if (!front) {
+                    ptrdiff_t i1 = off + delta - k2;
+                    if (i1 >= 0 && i1 < len && vf[i1] != -1) {
+                        ptrdiff_t x1 = vf[i1], y1 = off + x1 - i1;
+                        if (x1 >= N - x2) return {a0 + x1, b0 + y1};
+                    }
+                }
+            }
+            if (d >= max_cost && best_x + best_y > 0 && best_x + best_y < N + M)
+                return {a0 + best_x, b0 + best_y};
+        }
+        // no commonality at all: everything is replaced
+        return {a1, b0};
+    }
+};
+
+LineDiff diff_lines(string_view a, string_view b) {
+    LineDiff d;
+    d.a_lines = split_lines(a);
+    d.b_lines = split_lines(b);
+    if (a == b) return d;
+
+    // Trim the common prefix/suffix bytewise, then snap both cuts to line starts.
+    size_t p = common_prefix_len(a, b);
+    size_t pe = 0;
+    if (p > 0) {
+        size_t nl = a.rfind('\n', p - 1);
+        pe = (nl == string_view::npos) ? 0 : nl + 1;
+    }
+    size_t s = common_suffix_len(a.substr(pe), b.substr(pe));
+    bool a_start = (a.size() - s == pe) || a[a.size() - s - 1] == '\n';
+    bool b_start = (b.size() - s == pe) || b[b.size() - s - 1] == '\n';
+    if (!(a_start && b_start)) {
+        size_t nl = a.find('\n', a.size() - s);
+        s = (nl == string_view::npos) ? 0 : a.size() - nl - 1;
+    }
+    size_t pre_lines = static_cast<size_t>(std::count(a.begin(), a.begin() + pe, '\n'));
+    size_t suf_lines = static_cast<size_t>(std::count(a.end() - s, a.end(), '\n'));
+    if (s > 0 && a.back() != '\n') ++suf_lines;
+
+    size_t na = d.a_lines.size() - pre_lines - suf_lines;
+    size_t nb = d.b_lines.size() - pre_lines - suf_lines;
+    unordered_map<string_view, uint32_t> ids;
+    ids.reserve(na + nb);
+    auto intern = [&](const vector<string_view>& lines, size_t n) {
+        vector<uint32_t> out(n);
+        for (size_t i = 0; i < n; ++i)
+            out[i] = ids.try_emplace(lines[pre_lines + i], static_cast<uint32_t>(ids.size())).first->second;
+        return out;
+    };
+    vector<uint32_t> ia = intern(d.a_lines, na);
+    vector<uint32_t> ib = intern(d.b_lines, nb);
+
+    size_t ai = 0, bi = 0;
+    auto flush_change = [&](size_t a_to, size_t b_to) {
+        if (a_to > ai || b_to > bi)
+            d.changes.push_back({pre_lines + ai, a_to - ai, pre_lines + bi, b_to - bi});
+    };
+    for (const auto& m : DiffEngine(std::move(ia), std::move(ib)).run()) {
+        flush_change(m[0], m[1]);
+        ai = m[0] + m[2];
+        bi = m[1] + m[2];
+    }
+    flush_change(na, nb);
+    return d;
+}
+
+struct MergeResult {
+    string text;
+    size_t conflicts{};
+};
+
+// Three-way line merge in the style of diff3: changes of both sides against the
+// base are grouped wherever they overlap or touch, and groups that both sides
+// changed differently are written out between conflict markers.
+static MergeResult merge3(string_view base, string_view ours, string_view theirs,
+                          const string& ours_label, const string& theirs_label) {
+    LineDiff d_ours = diff_lines(base, ours);
+    LineDiff d_theirs = diff_lines(base, theirs);
+    const auto& bl = d_ours.a_lines;
+    const auto& co = d_ours.changes;
+    const auto& ct = d_theirs.changes;
+
+    MergeResult r;
+    r.text.reserve(max(ours.size(), theirs.size()));
+    auto put_lines = [&](const vector<string_view>& lines, size_t from, size_t to) {
+        for (size_t i = from; i < to; ++i) r.text += lines[i];
+    };
+    auto put_marker = [&](const string& marker) {
+        if (!r.text.empty() && r.text.back() != '\n') r.text += '\n';
+        r.text += marker;
+        r.text += '\n';
+    };
+    // The lines one side has in place of base [cs, ce), given its changes [first, last).
+    auto side_range = [](const vector<DiffChange>& ch, size_t first, size_t last, size_t cs, size_t ce) {
+        const DiffChange& f = ch[first];
+        const DiffChange& l = ch[last - 1];
+        return pair<size_t, size_t>{f.b - (f.a - cs), l.b + l.b_len + (ce - (l.a + l.a_len))};
+    };
+
+    size_t io = 0, it = 0, bpos = 0;
+    while (io < co.size() || it < ct.size()) {
+        bool take_ours = it == ct.size() || (io < co.size() && co[io].a <= ct[it].a);
+        size_t cs = take_ours ? co[io].a : ct[it].a;
+        size_t ce = take_ours ? co[io].a + co[io].a_len : ct[it].a + ct[it].a_len;
+        size_t o0 = io, t0 = it;
+        take_ours ? ++io : ++it;
+        for (bool grew = true; grew; ) {
+            grew = false;
+            if (io < co.size() && co[io].a <= ce) { ce = max(ce, co[io].a + co[io].a_len); ++io; grew = true; }
+            if (it < ct.size() && ct[it].a <= ce) { ce = max(ce, ct[it].a + ct[it].a_len); ++it; grew = true; }
+        }
+
+        put_lines(bl, bpos, cs);
+        bpos = ce;
+        if (it == t0) {
+            auto [s, e] = side_range(co, o0, io, cs, ce);
+            put_lines(d_ours.b_lines, s, e);
+            continue;
+        }
+        if (io == o0) {
+            auto [s, e] = side_range(ct, t0, it, cs, ce);
+            put_lines(d_theirs.b_lines, s, e);
+            continue;
+        }
+        auto [os, oe] = side_range(co, o0, io, cs, ce);
+        auto [ts, te] = side_range(ct, t0, it, cs, ce);
+        bool same = (oe - os) == (te - ts) &&
+                    std::equal(d_ours.b_lines.begin() + os, d_ours.b_lines.begin() + oe,
+                               d_theirs.b_lines.begin() + ts);
+        if (same) {
+            put_lines(d_ours.b_lines, os, oe);
+            continue;
+        }
+        ++r.conflicts;
+        put_marker("<<<<<<< " + ours_label);
+        put_lines(d_ours.b_lines, os, oe);
+        put_marker("=======");
+        put_lines(d_theirs.b_lines, ts, te);
+        put_marker(">>>>>>> " + theirs_label);
+    }
+    put_lines(bl, bpos, bl.size());
+    return r;
+}
+
+// SSE2 substring search: candidate positions are those where both the first and
+// the last byte of the needle match, checked 16 at a time.
+static size_t find_substr(string_view hay, string_view needle, size_t from = 0) {
+    const size_t k = needle.size();
+    if (k == 0) return from <= hay.size() ? from : string_view::npos;
+    if (from >= hay.size() || k > hay.size() - from) return string_view::npos;
+    size_t i = from;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle.front());
+    const __m128i last  = _mm_set1_epi8(needle.back());
+    for (; i + k - 1 + 16 <= hay.size(); i += 16) {
+        __m128i bf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay.data() + i));
+        __m128i bl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hay.data() + i + k - 1));
+        unsigned mask = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl))));
+        while (mask) {
+            size_t at = i + std::countr_zero(mask);
+            if (memcmp(hay.data() + at, needle.data(), k) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return hay.find(needle, i);
+}
+
+void append_quoted(string& out, string_view s) {
+    out += '"';
+    for (size_t i = 0;;) {
+        size_t j = s.find_first_of("\"\\", i);
+        if (j == string_view::npos) {
+            out.append(s.substr(i));
+            break;
+        }
+        out.append(s.substr(i, j - i));
+        out += '\\';
+        out += s[j];
+        i = j + 1;
+    }
+    out += '"';
+}
+
+
+// ---- repository ----
+
+CommitResult Repo::commit(string msg) {
+    VCS_LATENCY("Repo::commit");
+    string_view text = working.view();
+    uint64_t new_hash = hash64(text);
+
+    if (!merging && !history.empty() && history.back().content_hash == new_hash) return {head, true};
+
+    Version v;
+    v.id = history.size() + 1;
+    v.parent = head;
+    v.merge_parent = merging;
+    merging = 0;
+    v.ts_ns = now_ns();
+    v.content_hash = new_hash;
+    v.message = std::move(msg);
+    v.content = text;
+    grep_index.add(v.id, v.content);
+    index_version(v);
+    history.push_back(std::move(v));
+    head = history.back().id;
+
+    if (!detached) {
+        branches[current_branch] = head;
+        tip_moved(current_branch);
+        RoaringBitmap& bm = reach[current_branch];
+        bm.add(head);
+        if (history.back().merge_parent) add_ancestry(bm, history.back().merge_parent);
+    }
+    return {head, false};
+}
+
+void Repo::index_version(const Version& v) {
+    ChainInfo ci{0, v.id, v.ts_ns};
+    if (v.parent && v.parent < v.id) {
+        const ChainInfo& p = chain_info[v.parent - 1];
+        const ChainInfo& pj = chain_info[p.jump - 1];
+        ci.depth = p.depth + 1;
+        ci.max_ts = max(v.ts_ns, p.max_ts);
+        ci.jump = (p.depth - pj.depth == pj.depth - chain_info[pj.jump - 1].depth) ? pj.jump : v.parent;
+    }
+    chain_info.push_back(ci);
+    hash_index.add(v.content_hash, v.id);
+
+    uint64_t key = version_key(v);
+    version_keys.push_back(key);
+    key_index.try_emplace(key, v.id);
+}
+
+uint64_t Repo::version_key(const Version& v) const {
+    char buf[32];
+    uint64_t fields[4] = {key_of(v.parent), key_of(v.merge_parent), uint64_t(v.ts_ns), v.content_hash};
+    memcpy(buf, fields, sizeof(buf));
+    return hash64(string_view(buf, sizeof(buf))) ^ (hash64(v.message) * 0x9e3779b97f4a7c15ULL);
+}
+
+VersionId Repo::as_of(VersionId tip, int64_t ts_ns) const {
+    VersionId v = get(tip) ? tip : 0;
+    while (v && chain_info[v - 1].max_ts > ts_ns) {
+        VersionId j = chain_info[v - 1].jump;
+        v = (j != v && chain_info[j - 1].max_ts > ts_ns) ? j : history[v - 1].parent;
+    }
+    return v;
+}
+
+Result<VersionId> Repo::resolve_id(string_view tok) const {
+    if (tok.size() < 2 || tok[0] != '0' || (tok[1] != 'x' && tok[1] != 'X')) {
+        VersionId id = 0;
+        if (parse_number(tok, id)) return id;
+        return fail(Errc::invalid_argument, "invalid ID");
+    }
+    string_view digits = tok.substr(2);
+    uint64_t prefix = 0;
+    auto [end, ec] = from_chars(digits.data(), digits.data() + digits.size(), prefix, 16);
+    if (digits.empty() || digits.size() > 16 || ec != errc() || end != digits.data() + digits.size())
+        return fail(Errc::invalid_argument, "invalid ID");
+    if (digits.size() == 16) {
+        if (VersionId id = hash_index.find(prefix)) return id;
+        return fail(Errc::not_found, "no version with hash " + string(tok));
+    }
+    vector<uint64_t> hits = hash_index.match_prefix(prefix, static_cast<unsigned>(digits.size()), 10);
+    if (hits.size() == 1) return hash_index.find(hits[0]);
+    if (hits.empty()) return fail(Errc::not_found, "no version with hash prefix " + string(tok));
+    string msg = "ambiguous hash prefix " + string(tok) + ":";
+    for (uint64_t h : hits) msg += "\n  0x" + to_hex(h) + "  id " + to_string(hash_index.find(h));
+    if (hits.size() == 10) msg += "\n  ...";
+    return fail(Errc::conflict, std::move(msg));
+}
+
+vector<VersionId> Repo::chain_from(VersionId tip) const {
+    VCS_LATENCY("Repo::chain_from");
+    vector<VersionId> out;
+    while (tip != 0) {
+        out.push_back(tip);
+        const Version* v = get(tip);
+        if (!v) break;
+        tip = v->parent;
+    }
+    return out;
+}
+
+Result<vector<GrepHit>> Repo::grep(string_view pattern, const string* branch) const {
+    optional<vector<VersionId>> cand = grep_index.candidates(pattern);
+    vector<VersionId> ids;
+    if (branch) {
+        auto it = branches.find(*branch);
+        if (it == branches.end()) return fail(Errc::not_found, "no such branch");
+        // everything reachable, including what was merged into the branch
+        auto r = reach.find(*branch);
+        RoaringBitmap built = r == reach.end() ? reachable_from(it->second) : RoaringBitmap{};
+        const RoaringBitmap& bm = r == reach.end() ? built : r->second;
+        if (cand) {
+            for (auto c = cand->rbegin(); c != cand->rend(); ++c)
+                if (bm.contains(*c)) ids.push_back(*c);
+        } else {
+            bm.for_each([&](uint64_t id) { ids.push_back(id); });
+            reverse(ids.begin(), ids.end());
+        }
+    } else if (cand) {
+        ids.assign(cand->rbegin(), cand->rend());
+    } else {
+        for (VersionId id = history.size(); id > 0; --id) ids.push_back(id);
+    }
+
+    vector<GrepHit> hits;
+    for (VersionId id : ids) {
+        string_view content = history[id - 1].content;
+        size_t at = find_substr(content, pattern);
+        if (at == string_view::npos) continue;
+        size_t ls = content.rfind('\n', at);
+        ls = (ls == string_view::npos) ? 0 : ls + 1;
+        size_t le = content.find('\n', at + pattern.size());
+        if (le == string_view::npos) le = content.size();
+        size_t line_no = 1 + static_cast<size_t>(count(content.begin(), content.begin() + ls, '\n'));
+        hits.push_back({id, line_no, content.substr(ls, le - ls)});
+    }
+    return hits;
+}
+
+// Line origins of a version, derived from its parents' origins with one diff
+// per parent. The versions between id and its cached ancestors are computed
+// in ascending id order, which puts parents first, and each result is freed
+// once its last child in the batch has used it, so a deep first blame holds
+// only the frontier plus the checkpoints the cache keeps.
+const vector<VersionId>& Repo::line_origins(VersionId id) {
+    if (const vector<VersionId>* o = blame_cache.find(id)) return *o;
+
+    vector<VersionId> todo, stack{id};
+    unordered_set<VersionId> seen{id};
+    unordered_map<VersionId, uint32_t> uses;      // children in todo not computed yet
+    while (!stack.empty()) {
+        VersionId cur = stack.back();
+        stack.pop_back();
+        todo.push_back(cur);
+        const Version* v = get(cur);
+        for (VersionId p : {v->parent, v->merge_parent}) {
+            if (!p || blame_cache.find(p)) continue;
+            ++uses[p];
+            if (seen.insert(p).second) stack.push_back(p);
+        }
+    }
+    sort(todo.begin(), todo.end());
+
+    unordered_map<VersionId, vector<VersionId>> live;
+    auto origins_of = [&](VersionId p) -> const vector<VersionId>& {
+        auto it = live.find(p);
+        return it != live.end() ? it->second : *blame_cache.find(p);
+    };
+    for (VersionId cur : todo) {
+        const Version* v = get(cur);
+        LineDiff d = diff_lines(v->parent ? string_view(get(v->parent)->content) : string_view(), v->content);
+        vector<VersionId> origins(d.b_lines.size(), cur);
+        auto inherit = [&](const LineDiff& pd, const vector<VersionId>& from) {
+            size_t ai = 0, bi = 0;
+            for (size_t c = 0; c <= pd.changes.size(); ++c) {
+                size_t b_to = c < pd.changes.size() ? pd.changes[c].b : pd.b_lines.size();
+                for (; bi < b_to; ++ai, ++bi)
+                    if (origins[bi] == cur) origins[bi] = from[ai];
+                if (c < pd.changes.size()) {
+                    ai = pd.changes[c].a + pd.changes[c].a_len;
+                    bi = pd.changes[c].b + pd.changes[c].b_len;
+                }
+            }
+        };
+        if (v->parent) inherit(d, origins_of(v->parent));
+        if (v->merge_parent && find(origins.begin(), origins.end(), cur) != origins.end())
+            inherit(diff_lines(get(v->merge_parent)->content, v->content), origins_of(v->merge_parent));
+        for (VersionId p : {v->parent, v->merge_parent})
+            if (auto u = uses.find(p); u != uses.end() && --u->second == 0) live.erase(p);
+
+        if (cur == id || chain_info[cur - 1].depth % BlameCache::kStride == 0)
+            blame_cache.insert(cur, std::move(origins));
+        else if (uses.count(cur))
+            live.emplace(cur, std::move(origins));
+    }
+    blame_cache.trim(id);
+    return *blame_cache.find(id);
+}
+
+Result<span<const VersionId>> Repo::blame(VersionId id) {
+    if (!get(id)) return fail(Errc::not_found, "no such version");
+    return span<const VersionId>(line_origins(id));
+}
+
+// ---- working content ----
+
+void Repo::set_working(string_view text) {
+    (void)replace_working(0, working.size(), text);
+}
+
+void Repo::append_working(string_view text) {
+    (void)replace_working(working.size(), 0, text);
+}
+
+Result<> Repo::erase_working(size_t pos, size_t len) {
+    return replace_working(pos, len, {});
+}
+
+// Only the part of the span that actually changes is replaced and journaled.
+Result<> Repo::replace_working(size_t pos, size_t len, string_view text) {
+    if (pos > working.size()) return fail(Errc::invalid_argument, "pos out of range");
+    string_view old = working.span(pos, len);
+    size_t pre = common_prefix_len(old, text);
+    size_t suf = common_suffix_len(old.substr(pre), text.substr(pre));
+    string_view inserted = text.substr(pre, text.size() - pre - suf);
+    Edit e{pos + pre, inserted.size(), string(old.substr(pre, old.size() - pre - suf))};
+    working.replace(e.pos, e.text.size(), inserted);
+    record(std::move(e));
+    return {};
+}
+
+// An edit larger than the whole journal cannot be undone; it clears the
+// journal instead of evicting everything before it.
+void Repo::record(Edit e) {
+    if (e.len == 0 && e.text.empty()) return;
+    if (e.bytes() > kJournalBytes) {
+        drop_edits();
+        return;
+    }
+    redo_log.clear();
+    undo_bytes += e.bytes();
+    undo_log.push_back(std::move(e));
+    while (undo_bytes > kJournalBytes) {
+        undo_bytes -= undo_log.front().bytes();
+        undo_log.pop_front();
+    }
+}
+
+// Puts e.text back in place of the bytes it was replaced by, and returns the
+// edit that redoes it. The gap buffer's gap is still at the end of the last
+// edit, so undoing that edit moves only the bytes between the two.
+Repo::Edit Repo::revert(const Edit& e) {
+    Edit inverse{e.pos, e.text.size(), string(working.span(e.pos, e.len))};
+    working.replace(e.pos, e.len, e.text);
+    return inverse;
+}
+
+void Repo::drop_edits() {
+    undo_log.clear();
+    redo_log.clear();
+    undo_bytes = 0;
+}
+
+size_t Repo::undo(size_t n) {
+    size_t done = 0;
+    for (; done < n && !undo_log.empty(); ++done) {
+        undo_bytes -= undo_log.back().bytes();
+        redo_log.push_back(revert(undo_log.back()));
+        undo_log.pop_back();
+    }
+    return done;
+}
+
+size_t Repo::redo(size_t n) {
+    size_t done = 0;
+    for (; done < n && !redo_log.empty(); ++done) {
+        undo_log.push_back(revert(redo_log.back()));
+        undo_bytes += undo_log.back().bytes();
+        redo_log.pop_back();
+    }
+    return done;
+}
+
+// ---- branches ----
+
+Result<> Repo::checkout_version(VersionId id) {
+    VCS_LATENCY("Repo::checkout_version");
+    const Version* v = get(id);
+    if (!v) return fail(Errc::not_found, "no such version");
+    working.assign(v->content);
+    head = id;
+    detached = true; 
+    merging = 0;
+    drop_edits();
+    return {};
+}
+
+Result<> Repo::switch_branch(const string& name) {
+    VCS_LATENCY("Repo::switch_branch");
+    auto it = branches.find(name);
+    if (it == branches.end()) return fail(Errc::not_found, "no such branch");
+    current_branch = name;
+    detached = false;
+    head = it->second;
+    merging = 0;
+    drop_edits();
+
+    if (head == 0) {
+        working.clear();
+    } else if (const Version* v = get(head)) {
+        working.assign(v->content);
+    } else {
+        working.clear();
+        head = 0;
+        branches[current_branch] = 0;
+        tip_moved(current_branch);
+        reach[current_branch] = RoaringBitmap{};
+        return fail(Errc::corrupt, "branch head invalid, resetting");
+    }
+    return {};
+}
+
+Result<> Repo::create_branch(const string& name, VersionId at) {
+    if (branches.count(name)) return fail(Errc::already_exists, "branch already exists");
+    if (at != 0 && !get(at)) return fail(Errc::not_found, "no such version");
+    branches[name] = at;
+    refs_replaced();
+    reach[name] = reachable_from(at);
+    return {};
+}
+
+Result<> Repo::delete_branch(const string& name) {
+    if (!branches.count(name)) return fail(Errc::not_found, "no such branch");
+    if (name == current_branch && !detached) return fail(Errc::bad_state, "cannot delete current branch");
+    branches.erase(name);
+    refs_replaced();
+    reach.erase(name);
+    return {};
+}
+
+// Adds `from` and its ancestors to an ancestor-closed set, stopping at
+// versions that are already in it.
+void Repo::add_ancestry(RoaringBitmap& bm, VersionId from) const {
+    vector<VersionId> stack{from};
+    while (!stack.empty()) {
+        VersionId id = stack.back();
+        stack.pop_back();
+        const Version* v = get(id);
+        if (!v || bm.contains(id)) continue;
+        bm.add(id);
+        stack.push_back(v->parent);
+        stack.push_back(v->merge_parent);
+    }
+    bm.optimize();
+}
+
+Repo::TipBitmaps Repo::tip_bitmaps() const {
+    TipBitmaps tips;
+    tips.reserve(reach.size());
+    for (const auto& [nm, bm] : reach) {
+        auto it = branches.find(nm);
+        if (it != branches.end() && it->second) tips.emplace(it->second, &bm);
+    }
+    return tips;
+}
+
+RoaringBitmap Repo::reachable_from(VersionId at) const {
+    if (at && !detached && at == head) {
+        auto it = reach.find(current_branch);
+        if (it != reach.end()) return it->second;
+    }
+    return reachable_from(at, tip_bitmaps());
+}
+
+// Reachable set of an arbitrary version.  Branch tips met on the way
+// contribute their whole bitmap instead of being walked.
+RoaringBitmap Repo::reachable_from(VersionId at, const TipBitmaps& tips) const {
+    RoaringBitmap out;
+    vector<VersionId> stack{at};
+    while (!stack.empty()) {
+        VersionId id = stack.back();
+        stack.pop_back();
+        const Version* v = get(id);
+        if (!v || out.contains(id)) continue;
+        if (auto t = tips.find(id); t != tips.end()) {
+            out.union_with(*t->second);
+            continue;
+        }
+        out.add(id);
+        stack.push_back(v->parent);
+        stack.push_back(v->merge_parent);
+    }
+    out.optimize();
+    return out;
+}
+
+Result<vector<string_view>> Repo::branches_containing(VersionId id) const {
+    if (!get(id)) return fail(Errc::not_found, "no such version");
+    vector<string_view> names;
+    for (const auto& [nm, bm] : reach)
+        if (bm.contains(id)) names.push_back(nm);
+    return names;
+}
+
+GcReport Repo::gc() const {
+    RoaringBitmap live;
+    for (const auto& kv : reach) live.union_with(kv.second);
+    if (head) add_ancestry(live, head);
+    GcReport r;
+    for (const Version& v : history) {
+        if (live.contains(v.id)) continue;
+        r.unreachable.push_back(v.id);
+        r.bytes += v.content.size() + v.message.size();
+    }
+    return r;
+}
+
+MemoryReport Repo::memory_report(size_t top) const {
+    MemoryReport r;
+    size_t n = r.versions = history.size();
+
+    unordered_map<uint64_t, uint64_t> first_size;   // content hash -> size of its first version
+    first_size.reserve(n);
+    auto smaller = [](const pair<VersionId, uint64_t>& a, const pair<VersionId, uint64_t>& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    };
+    for (const Version& v : history) {
+        r.content_bytes += v.content.size();
+        r.content_heap += heap_bytes(v.content);
+        r.message_bytes += v.message.size();
+        r.message_heap += heap_bytes(v.message);
+
+        auto [it, fresh] = first_size.try_emplace(v.content_hash, v.content.size());
+        if (fresh || it->second != v.content.size()) ++r.distinct_contents;
+        else r.duplicate_bytes += v.content.size();
+
+        // a min-heap of the `top` largest so far
+        if (top == 0) continue;
+        if (r.largest.size() < top) {
+            r.largest.emplace_back(v.id, v.content.size());
+            push_heap(r.largest.begin(), r.largest.end(), smaller);
+        } else if (smaller({v.id, v.content.size()}, r.largest.front())) {
+            pop_heap(r.largest.begin(), r.largest.end(), smaller);
+            r.largest.back() = {v.id, v.content.size()};
+            push_heap(r.largest.begin(), r.largest.end(), smaller);
+        }
+    }
+    sort_heap(r.largest.begin(), r.largest.end(), smaller);
+
+    r.history_bytes = history.memory_bytes();
+    r.branch_bytes = branches.memory_bytes() + heap_bytes(current_branch);
+    r.working_bytes = working.memory_bytes() + undo_bytes;
+    for (const Edit& e : redo_log) r.working_bytes += e.bytes();
+
+    uint64_t reach_bytes = reach.memory_bytes();
+    for (const auto& [nm, bm] : reach) reach_bytes += bm.memory_bytes();
+    uint64_t blame_bytes = blame_cache.memory_bytes();
+    r.indexes = {
+        {"trigram index", grep_index.memory_bytes()},
+        {"hash index", hash_index.memory_bytes()},
+        {"branch reach", reach_bytes},
+        {"version keys", version_keys.memory_bytes() + hash_map_bytes(key_index)},
+        {"chain info", chain_info.memory_bytes()},
+        {"blame cache", blame_bytes},
+    };
+
+    // The single owner of each version: a branch index, kHead for a detached
+    // HEAD, kMany once a second one reaches it.
+    constexpr uint32_t kNone = UINT32_MAX, kMany = UINT32_MAX - 1;
+    vector<uint32_t> owner(n + 1, kNone);
+    auto claim = [&](uint32_t who) {
+        return [&owner, who](uint64_t id) {
+            if (id < owner.size()) owner[id] = owner[id] == kNone || owner[id] == who ? who : kMany;
+        };
+    };
+    vector<MemoryReport::Owner> owners;
+    for (const auto& [nm, bm] : reach) {
+        bm.for_each(claim(uint32_t(owners.size())));
+        owners.push_back({nm});
+    }
+    if (detached && head) {
+        reachable_from(head).for_each(claim(uint32_t(owners.size())));
+        owners.push_back({"HEAD"});
+    }
+    for (size_t id = 1; id <= n; ++id) {
+        uint32_t o = owner[id];
+        if (o == kMany) continue;
+        MemoryReport::Owner& w = o == kNone ? r.unreachable : owners[o];
+        ++w.versions;
+        w.bytes += history[id - 1].content.size() + history[id - 1].message.size();
+    }
+    for (MemoryReport::Owner& w : owners)
+        if (w.versions) r.exclusive.push_back(w);
+    sort(r.exclusive.begin(), r.exclusive.end(), [](const auto& a, const auto& b) {
+        return a.bytes > b.bytes || (a.bytes == b.bytes && a.name < b.name);
+    });
+    return r;
+}
+
+VerifyReport Repo::verify() const {
+    VerifyReport r;
+    size_t n = r.versions = history.size();
+    mutex mu;
+    task_pool().parallel_for(n, 64, [&](size_t lo, size_t hi) {
+        vector<pair<VersionId, const char*>> found;
+        for (size_t i = lo; i < hi; ++i) {
+            const Version& v = history[i];
+            if (v.id != i + 1) found.emplace_back(i + 1, "id out of sequence");
+            else if (v.parent > i || v.merge_parent > i) found.emplace_back(v.id, "parent is not older");
+            else if (hash64(v.content) != v.content_hash) found.emplace_back(v.id, "content hash mismatch");
+        }
+        if (found.empty()) return;
+        lock_guard<mutex> lk(mu);
+        r.bad_versions.insert(r.bad_versions.end(), found.begin(), found.end());
+    });
+    sort(r.bad_versions.begin(), r.bad_versions.end());
+    for (const auto& [nm, hid] : branches)
+        if (hid > n) r.bad_tips.emplace_back(nm, hid);
+    return r;
+}
+
+VersionId Repo::merge_base(VersionId a, VersionId b) const {
+    if (a == 0 || b == 0) return 0;
+    if (a == b) return a;
+    unordered_map<VersionId, uint8_t> seen{{a, 1}, {b, 2}};
+    priority_queue<VersionId> q;
+    q.push(a);
+    q.push(b);
+    while (!q.empty()) {
+        VersionId id = q.top();
+        q.pop();
+        uint8_t flags = seen[id];
+        if (flags == 3) return id;
+        const Version* v = get(id);
+        if (!v) continue;
+        for (VersionId p : {v->parent, v->merge_parent}) {
+            if (p == 0) continue;
+            uint8_t& pf = seen[p];
+            if ((pf | flags) != pf) {
+                pf |= flags;
+                q.push(p);
+            }
+        }
+    }
+    return 0;
+}
+
+Result<MergeOutcome> Repo::merge_branch(const string& name) {
+    if (detached) return fail(Errc::bad_state, "cannot merge in detached HEAD");
+    if (merging) return fail(Errc::bad_state, "merge in progress; commit it or run 'merge --abort'");
+    auto it = branches.find(name);
+    if (it == branches.end()) return fail(Errc::not_found, "no such branch");
+    const Version* hv = get(head);
+    if (working.view() != (hv ? string_view(hv->content) : string_view()))
+        return fail(Errc::bad_state, "uncommitted changes; commit them first");
+
+    VersionId theirs = it->second;
+    VersionId base = merge_base(head, theirs);
+    if (theirs == 0 || base == theirs) return MergeOutcome{MergeOutcome::up_to_date};
+    if (base == head) {
+        head = theirs;
+        branches[current_branch] = head;
+        tip_moved(current_branch);
+        reach[current_branch] = reachable_from(theirs);
+        working.assign(get(head)->content);
+        drop_edits();
+        return MergeOutcome{MergeOutcome::fast_forward, head};
+    }
+
+    const Version* bv = get(base);
+    MergeResult m = merge3(bv ? string_view(bv->content) : string_view(), working.view(),
+                           get(theirs)->content, current_branch, name);
+    working.assign(std::move(m.text));
+    merging = theirs;
+    drop_edits();
+    if (m.conflicts) return MergeOutcome{MergeOutcome::conflicted, 0, base, m.conflicts};
+    VersionId id = commit("Merge branch '" + name + "' into " + current_branch).id;
+    return MergeOutcome{MergeOutcome::merged, id, base};
+}
+
+Result<> Repo::abort_merge() {
+    if (!merging) return fail(Errc::bad_state, "no merge in progress");
+    merging = 0;
+    const Version* hv = get(head);
+    working.assign(hv ? hv->content : string());
+    drop_edits();
+    return {};
+}
+
+// Oldest tip first, so later ones can reuse the bitmaps of earlier ones.
+void Repo::rebuild_reach() {
+    for (auto it = reach.begin(); it != reach.end(); )
+        it = branches.count(it->first) ? next(it) : reach.erase(it);
+    vector<pair<VersionId, const string*>> todo;
+    for (const auto& [nm, tip] : branches) {
+        auto it = reach.find(nm);
+        if (it == reach.end() || (tip && !it->second.contains(tip)) || (!tip && !it->second.empty()))
+            todo.push_back({tip, &nm});
+    }
+    sort(todo.begin(), todo.end());
+    for (const auto& [tip, nm] : todo) reach.erase(*nm);
+
+    TipBitmaps tips = tip_bitmaps();
+    vector<RoaringBitmap> fresh;
+    fresh.reserve(todo.size());
+    for (const auto& [tip, nm] : todo) {
+        fresh.push_back(reachable_from(tip, tips));
+        if (tip) tips.emplace(tip, &fresh.back());
+    }
+    for (size_t i = 0; i < todo.size(); ++i) reach[*todo[i].second] = std::move(fresh[i]);
+}
+
+// ---- replication ----
+
+VersionId Repo::ancestor_at_depth(VersionId id, uint64_t depth) const {
+    while (id && chain_info[id - 1].depth > depth) {
+        VersionId j = chain_info[id - 1].jump;
+        id = (j != id && chain_info[j - 1].depth >= depth) ? j : history[id - 1].parent;
+    }
+    return id;
+}
+
+vector<pair<string_view, uint64_t>> Repo::refs() const {
+    vector<pair<string_view, uint64_t>> out;
+    out.reserve(branches.size());
+    for (const auto& [nm, hid] : branches) out.emplace_back(nm, key_of(hid));
+    return out;
+}
+
+vector<uint64_t> Repo::have_keys(size_t max) const {
+    vector<VersionId> tips;
+    for (const auto& kv : branches)
+        if (kv.second) tips.push_back(kv.second);
+    sort(tips.begin(), tips.end());
+    tips.erase(unique(tips.begin(), tips.end()), tips.end());
+    vector<uint64_t> out;
+    unordered_set<VersionId> seen;
+    for (uint64_t step = 0; out.size() < max; step = step ? step * 2 : 1) {
+        bool any = false;
+        for (VersionId t : tips) {
+            uint64_t d = chain_info[t - 1].depth;
+            if (step > d) continue;
+            any = true;
+            VersionId a = ancestor_at_depth(t, d - step);
+            if (seen.insert(a).second) out.push_back(key_of(a));
+            if (out.size() >= max) break;
+        }
+        if (!any) break;
+    }
+    return out;
+}
+
+// Ids shrink along parent edges, so a max-heap walk reaches each version
+// after all of its descendants, when its flags are final. The walk stops
+// once no entry reachable only from `wants` is left, so its cost follows
+// the new history rather than the whole history.
+vector<VersionId> Repo::missing_versions(const vector<VersionId>& wants, const vector<VersionId>& common) const {
+    unordered_map<VersionId, uint8_t> flags;   // 1: from wants, 2: from common
+    priority_queue<VersionId> heap;
+    size_t only_wanted = 0;
+    auto mark = [&](VersionId id, uint8_t f) {
+        if (!id) return;
+        uint8_t& x = flags[id];
+        if ((x | f) == x) return;
+        if (!x) heap.push(id);
+        if (x == 1) --only_wanted;
+        x |= f;
+        if (x == 1) ++only_wanted;
+    };
+    for (VersionId id : common) mark(id, 2);
+    for (VersionId id : wants) mark(id, 1);
+    vector<VersionId> out;
+    while (only_wanted) {
+        VersionId id = heap.top();
+        heap.pop();
+        uint8_t f = flags[id];
+        if (f == 1) {
+            --only_wanted;
+            out.push_back(id);
+        }
+        const Version& v = history[id - 1];
+        mark(v.parent, f);
+        mark(v.merge_parent, f);
+    }
+    reverse(out.begin(), out.end());
+    return out;
+}
+
+void Repo::write_pack(const vector<VersionId>& ids, string& pack) const {
+    pack += "pack " + to_string(ids.size()) + "\n";
+    for (VersionId id : ids) {
+        const Version& v = history[id - 1];
+        pack += "v " + to_hex(key_of(id)) + " " + to_hex(key_of(v.parent)) + " " + to_hex(key_of(v.merge_parent))
+              + " " + to_string(v.ts_ns) + " " + to_hex(v.content_hash) + "\nm ";
+        append_quoted(pack, v.message);
+        pack += "\n";
+        string delta;
+        if (const Version* p = get(v.parent)) {
+            LineDiff d = diff_lines(p->content, v.content);
+            size_t ai = 0, ops = 0;
+            for (const DiffChange& ch : d.changes) {
+                if (ch.a > ai) delta += "= " + to_string(ch.a - ai) + "\n", ++ops;
+                if (ch.a_len) delta += "- " + to_string(ch.a_len) + "\n", ++ops;
+                if (ch.b_len) {
+                    string text;
+                    for (size_t i = 0; i < ch.b_len; ++i) text += d.b_lines[ch.b + i];
+                    delta += "+ ";
+                    append_quoted(delta, text);
+                    delta += "\n";
+                    ++ops;
+                }
+                ai = ch.a + ch.a_len;
+            }
+            if (d.a_lines.size() > ai) delta += "= " + to_string(d.a_lines.size() - ai) + "\n", ++ops;
+            delta = "d " + to_string(ops) + "\n" + delta;
+        }
+        if (!delta.empty() && delta.size() < v.content.size()) {
+            pack += delta;
+        } else {
+            pack += "c ";
+            append_quoted(pack, v.content);
+            pack += "\n";
+        }
+    }
+}
+
+Result<size_t> Repo::apply_pack(TextCursor& c) {
+    auto bad = [](const char* what) { return fail(Errc::corrupt, what); };
+    string_view w;
+    uint64_t n = 0;
+    size_t added = 0;
+    if (!c.word(w) || w != "pack" || !c.number(n)) return bad("bad pack header");
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t key = 0, pkey = 0, mkey = 0;
+        Version v;
+        string_view raw;
+        if (!c.word(w) || w != "v" || !c.hex(key) || !c.hex(pkey) || !c.hex(mkey) || !c.number(v.ts_ns) ||
+            !c.hex(v.content_hash)) return bad("bad pack entry");
+        if (!c.word(w) || w != "m" || !c.quoted_raw(raw)) return bad("bad pack message");
+        TextCursor::unquote(raw, v.message);
+        v.parent = find_key(pkey);
+        v.merge_parent = find_key(mkey);
+        if ((pkey && !v.parent) || (mkey && !v.merge_parent)) return bad("pack refers to an unknown parent");
+        if (!c.word(w)) return bad("bad pack content");
+        if (w == "c") {
+            if (!c.quoted_raw(raw)) return bad("bad pack content");
+            TextCursor::unquote(raw, v.content);
+        } else if (w == "d" && v.parent) {
+            vector<string_view> base = split_lines(history[v.parent - 1].content);
+            size_t ops = 0, ai = 0;
+            string text;
+            if (!c.number(ops)) return bad("bad pack delta");
+            for (size_t k = 0; k < ops; ++k) {
+                size_t len = 0;
+                if (!c.word(w)) return bad("bad pack delta");
+                if (w == "+") {
+                    if (!c.quoted_raw(raw)) return bad("bad pack delta");
+                    TextCursor::unquote(raw, text);
+                    v.content += text;
+                    continue;
+                }
+                if ((w != "=" && w != "-") || !c.number(len) || len > base.size() - ai) return bad("bad pack delta");
+                if (w == "=")
+                    for (size_t j = 0; j < len; ++j) v.content += base[ai + j];
+                ai += len;
+            }
+        } else {
+            return bad("bad pack content");
+        }
+        if (hash64(v.content) != v.content_hash) return bad("pack content does not match its hash");
+        if (version_key(v) != key) return bad("pack entry does not match its key");
+        if (find_key(key)) continue;
+        v.id = history.size() + 1;
+        grep_index.add(v.id, v.content);
+        index_version(v);
+        history.push_back(std::move(v));
+        ++added;
+    }
+    return added;
+}
+
+Result<RefUpdate> Repo::fast_forward(const string& name, VersionId id) {
+    auto it = branches.find(name);
+    if (it == branches.end()) {
+        branches[name] = id;
+        refs_replaced();
+        reach[name] = reachable_from(id);
+        return RefUpdate{RefUpdate::created, 0, id};
+    }
+    VersionId cur = it->second;
+    if (cur == id) return RefUpdate{RefUpdate::up_to_date, cur, id};
+    VersionId base = cur ? merge_base(cur, id) : 0;
+    if (base == id) return RefUpdate{RefUpdate::already_contains, cur, id};
+    if (base != cur) return fail(Errc::conflict, "non-fast-forward");
+    bool checked_out = !detached && name == current_branch;
+    const Version* hv = get(head);
+    if (checked_out && (merging || working.view() != (hv ? string_view(hv->content) : string_view())))
+        return fail(Errc::bad_state, "checked out with uncommitted changes");
+    it->second = id;
+    tip_moved(name);
+    add_ancestry(reach[name], id);
+    if (checked_out) {
+        head = id;
+        working.assign(get(id)->content);
+        drop_edits();
+    }
+    return RefUpdate{RefUpdate::updated, cur, id};
+}
+
+// ---- files ----
+
+Result<MappedFile> MappedFile::open(const string& path) {
+    MappedFile f;
+#if __has_include(<sys/mman.h>)
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return fail(Errc::io, "cannot open file for read");
+    struct stat st{};
+    bool ok = fstat(fd, &st) == 0 && !S_ISDIR(st.st_mode);
+    if (ok && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+            f.map = static_cast<const char*>(p);
+            f.map_size = size_t(st.st_size);
+        }
+    }
+    char buf[64 * 1024];
+    while (ok && !f.map) {
+        ssize_t r = ::read(fd, buf, sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            ok = r == 0;
+            break;
+        }
+        f.owned.append(buf, size_t(r));
+    }
+    ::close(fd);
+    if (!ok) return fail(Errc::io, "read failed");
+#else
+    ifstream in(path, ios::binary);
+    if (!in) return fail(Errc::io, "cannot open file for read");
+    ostringstream buf;
+    if (!(buf << in.rdbuf()) && in.peek() != EOF) return fail(Errc::io, "read failed");
+    f.owned = std::move(buf).str();
+#endif
+    return f;
+}
+
+MappedFile::~MappedFile() {
+#if __has_include(<sys/mman.h>)
+    if (map) munmap(const_cast<char*>(map), map_size);
+#endif
+}
+
+// ---- persistence ----
+
+void Repo::append_version(string& out, const Version& v) {
+    out += "id " + to_string(v.id) + "\n";
+    out += "parent " + to_string(v.parent) + "\n";
+    if (v.merge_parent) out += "merge_parent " + to_string(v.merge_parent) + "\n";
+    out += "ts_ns " + to_string(v.ts_ns) + "\n";
+    out += "hash " + to_string(v.content_hash) + "\n";
+    out += "message ";
+    append_quoted(out, v.message);
+    out += "\ncontent ";
+    append_quoted(out, v.content);
+    out += "\n----\n";
+}
+
+Result<> Repo::save(const string& path) const {
+    VCS_LATENCY("Repo::save");
+    ofstream os(path); 
+    if (!os) return fail(Errc::io, "cannot open file for write");
+
+    // Versions are formatted in parallel, a window of blocks at a time, and
+    // written in order.
+    constexpr size_t kBlock = 256;
+    TaskPool& pool = task_pool();
+    size_t n = history.size();
+    size_t nblocks = (n + kBlock - 1) / kBlock;
+    vector<string> text(size_t(pool.size()) * 2);
+    os << "count " << static_cast<uint64_t>(n) << "\n";
+    for (size_t b0 = 0; b0 < nblocks; b0 += text.size()) {
+        size_t w = min(text.size(), nblocks - b0);
+        pool.parallel_for(w, 1, [&](size_t lo, size_t hi) {
+            for (size_t b = lo; b < hi; ++b) {
+                string& t = text[b];
+                t.clear();
+                for (size_t i = (b0 + b) * kBlock; i < min(n, (b0 + b + 1) * kBlock); ++i)
+                    append_version(t, history[i]);
+            }
+        });
+        for (size_t b = 0; b < w; ++b) os.write(text[b].data(), static_cast<streamsize>(text[b].size()));
+    }
+
+    // packed refs: sorted, front-coded against the previous name
+    os << "packed-refs " << branches.size() << "\n";
+    string_view prev;
+    for (const auto& [nm, hid] : branches) {
+        size_t shared = common_prefix_len(prev, nm);
+        os << shared << " " << std::quoted(string_view(nm).substr(shared)) << " "
+           << static_cast<uint64_t>(hid) << "\n";
+        prev = nm;
+    }
+    os << "current_branch " << std::quoted(current_branch) << "\n";
+    os << "detached " << (detached ? 1 : 0) << "\n";
+
+    os << "head " << static_cast<uint64_t>(head) << "\n";
+    // A merge in progress needs its working content: that is where the
+    // conflicts are being resolved.
+    if (merging) {
+        os << "merging " << static_cast<uint64_t>(merging) << "\n";
+        os << "merge_working " << std::quoted(working.str()) << "\n";
+    }
+    grep_index.save(os);
+    os << "reach " << reach.size() << "\n";
+    for (const auto& [nm, bm] : reach) {
+        os << std::quoted(nm) << " ";
+        bm.save(os);
+        os << "\n";
+    }
+
+    if (!os) return fail(Errc::io, "write failed");
+    return {};
+}
+
+Result<vector<string>> Repo::load(const string& path) {
+    VCS_LATENCY("Repo::load");
+    Result<MappedFile> file = MappedFile::open(path);
+    if (!file) return unexpected(std::move(file.error()));
+    string_view buf = file->view();
+
+    history.clear();
+    chain_info.clear();
+    version_keys.clear();
+    key_index.clear();
+    hash_index.clear();
+    reach.clear();
+    blame_cache.clear();
+    grep_index.clear();
+    working.clear();
+    drop_edits();
+    head = 0;
+    merging = 0;
+    branches.clear();
+    refs_replaced();
+    current_branch = "main";
+    detached = false;
+
+    auto bad = [](const char* what) { return fail(Errc::corrupt, what); };
+
+    // Versions: one sequential pass finds the fields, then the quoted
+    // message and content are decoded in parallel.
+    TextCursor c{buf};
+    string_view word;
+    uint64_t count = 0;
+
+    if (!c.word(word) || word != "count") return bad("expected 'count'");
+    // The shortest record: id 1 / parent 0 / ts_ns 0 / hash 0 / message "" /
+    // content "" / ----, one per line.
+    constexpr size_t kMinRecordBytes = 56;
+    if (!c.number(count) || count > buf.size() / kMinRecordBytes) return bad("bad count");
+    c.line(word);
+
+    vector<Version> parsed(count);
+    vector<pair<string_view, string_view>> raw(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        Version& v = parsed[i];
+        if (!c.word(word) || word != "id") return bad("expected 'id'");
+        if (!c.number(v.id)) return bad("bad id");
+        c.line(word);
+
+        if (!c.word(word) || word != "parent") return bad("expected 'parent'");
+        if (!c.number(v.parent)) return bad("bad parent");
+        c.line(word);
+
+        if (!c.word(word)) return bad("expected 'ts_ns'");
+        if (word == "merge_parent") {
+            if (!c.number(v.merge_parent)) return bad("bad merge_parent");
+            c.line(word);
+            if (!c.word(word)) return bad("expected 'ts_ns'");
+        }
+        if (word != "ts_ns") return bad("expected 'ts_ns'");
+        if (!c.number(v.ts_ns)) return bad("bad ts_ns");
+        c.line(word);
+
+        if (!c.word(word) || word != "hash") return bad("expected 'hash'");
+        if (!c.number(v.content_hash)) return bad("bad hash");
+        c.line(word);
+
+        if (!c.word(word) || word != "message") return bad("expected 'message'");
+        if (!c.quoted_raw(raw[i].first)) return bad("bad message");
+        c.line(word);
+
+        if (!c.word(word) || word != "content") return bad("expected 'content'");
+        if (!c.quoted_raw(raw[i].second)) return bad("bad content");
+        c.line(word);
+
+        if (!c.line(word)) return bad("missing separator");
+        if (word != "----") return bad("expected '----'");
+    }
+    task_pool().parallel_for(count, 64, [&](size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; ++i) {
+            TextCursor::unquote(raw[i].first, parsed[i].message);
+            TextCursor::unquote(raw[i].second, parsed[i].content);
+        }
+    });
+    // Parents must precede their children: index_version reads their keys.
+    for (uint64_t i = 0; i < count; ++i) {
+        const Version& v = parsed[i];
+        if (v.id != i + 1) return bad("ids out of sequence");
+        if (v.parent >= v.id || v.merge_parent >= v.id) return bad("parent is not an earlier version");
+    }
+    for (Version& v : parsed) {
+        index_version(v);
+        history.push_back(std::move(v));
+    }
+    vector<Version>().swap(parsed);
+
+    ispanstream is(span<const char>(buf.data() + c.pos, buf.size() - c.pos));
+    string key, dummy;
+    size_t bcount = 0;
+    if (!(is >> key) || (key != "branches" && key != "packed-refs")) return bad("expected 'branches'");
+    if (!(is >> bcount)) return bad("bad branches count");
+    getline(is, dummy);
+
+    const bool packed = (key == "packed-refs");
+    string prev;
+    for (size_t i = 0; packed && i < bcount; ++i) {
+        size_t shared = 0;
+        string suffix;
+        VersionId hid{};
+        if (!(is >> shared >> std::quoted(suffix) >> hid) || shared > prev.size()) return bad("bad packed ref");
+        if (hid > history.size()) return bad("branch tip is not a version");
+        prev.resize(shared);
+        prev += suffix;
+        branches[prev] = hid;
+    }
+    for (size_t i = 0; !packed && i < bcount; ++i) {
+        string nm;
+        VersionId hid{};
+        if (!(is >> key) || key != "bname") return bad("expected 'bname'");
+        if (!(is >> std::quoted(nm))) return bad("bad branch name");
+        if (!(is >> key) || key != "bhead") return bad("expected 'bhead'");
+        if (!(is >> hid)) return bad("bad bhead");
+        if (hid > history.size()) return bad("branch tip is not a version");
+        getline(is, dummy);
+        branches[nm] = hid;
+    }
+
+    if (!(is >> key) || key != "current_branch") return bad("expected 'current_branch'");
+    if (!(is >> std::quoted(current_branch))) return bad("bad current_branch");
+    getline(is, dummy);
+
+    int det = 0;
+    if (!(is >> key) || key != "detached") return bad("expected 'detached'");
+    if (!(is >> det)) return bad("bad detached");
+    detached = (det != 0);
+    getline(is, dummy);
+
+    if (!(is >> key) || key != "head") return bad("expected 'head'");
+    VersionId h = 0;
+    if (!(is >> h)) return bad("bad head");
+    if (h > history.size()) return bad("head is not a version");
+    head = h;
+
+    // optional trailing sections
+    vector<string> warnings;
+    optional<string> merge_working;
+    while (is >> key) {
+        if (key == "merge_working") {
+            if (!(is >> std::quoted(merge_working.emplace()))) {
+                warnings.push_back("bad merge_working");
+                merge_working.reset();
+                break;
+            }
+        } else if (key == "merging") {
+            if (!(is >> merging)) { warnings.push_back("bad merging"); merging = 0; break; }
+            if (merging > history.size()) { warnings.push_back("merging is not a version, dropped"); merging = 0; }
+        } else if (key == "reach") {
+            size_t n = 0;
+            bool ok = static_cast<bool>(is >> n);
+            for (size_t i = 0; ok && i < n; ++i) {
+                string nm;
+                ok = (is >> std::quoted(nm)) && reach[nm].load(is) && reach[nm].max() <= history.size();
+            }
+            if (!ok) {
+                warnings.push_back("bad reach section, rebuilding");
+                reach.clear();
+                break;
+            }
+        } else if (key == "trigrams") {
+            if (!grep_index.load(is) || grep_index.indexed_upto > history.size()) {
+                warnings.push_back("bad trigram index, rebuilding");
+                grep_index.clear();
+                break;
+            }
+        } else {
+            warnings.push_back("unknown section '" + key + "'");
+            break;
+        }
+    }
+    for (VersionId id = grep_index.indexed_upto + 1; id <= history.size(); ++id)
+        grep_index.add(id, history[id - 1].content);
+    rebuild_reach();
+
+    if (merging && !merge_working) {
+        warnings.push_back("merge in progress without its working content, dropped");
+        merging = 0;
+    }
+    if (merging) {
+        working.assign(std::move(*merge_working));
+    } else if (head != 0) {
+        const Version* hv = get(head);
+        if (hv) working.assign(hv->content);
+    } else {
+        working.clear();
+    }
+    if (branches.empty()) branches["main"] = 0;
+    drop_edits();
+    return warnings;
+}
+
+} // namespace vcs
@@ -0,0 +1,2067 @@
+// Versioned text repository engine: history, branches, merges, search,
+// persistence and replication. The REPL in newmain.cpp is one client; a service
+// can embed it in-process through the same calls. Nothing here prints: failures
+// come back as Error values and queries return data, so callers choose the
+// formatting.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <expected>
+#include <functional>
+#include <iomanip>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <queue>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace vcs {
+
+using VersionId = uint64_t;
+
+// "YYYY-MM-DD HH:MM:SS" in local time.
+std::string fmt_time_local(int64_t ts_ns);
+
+// Accepts "YYYY-MM-DD[ HH:MM[:SS]]" in local time (as printed by log) or raw
+// seconds since the epoch.
+std::optional<int64_t> parse_time_ns(const std::string& s);
+
+uint64_t hash64(std::string_view s);
+
+// 16 lowercase hex digits.
+std::string to_hex(uint64_t x);
+
+// ---- formatting ----
+// Appending forms of the above for output assembled in a reused buffer.
+
+void append_hex(std::string& out, uint64_t x);
+void append_number(std::string& out, uint64_t x);
+
+// Same text as fmt_time_local. The local UTC offset is cached per thread for
+// each UTC day, so most calls skip localtime_r.
+void append_time_local(std::string& out, int64_t ts_ns);
+
+// ---- task scheduler ----
+
+// Work-stealing pool. The calling thread counts as one of `threads` and helps
+// out while it waits. Each thread owns a deque, pushing and popping at the
+// back; an idle thread steals from the front of another's deque, which holds
+// the oldest and largest pieces of a recursively split range. Queue 0 belongs
+// to threads outside the pool and is shared between them.
+class TaskPool {
+public:
+    explicit TaskPool(unsigned threads) : queues(std::max(1u, threads)) {
+        for (size_t i = 1; i < queues.size(); ++i) workers.emplace_back([this, i] { run_worker(i); });
+    }
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lk(idle_mu);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    unsigned size() const { return unsigned(queues.size()); }
+
+    // Calls f(begin, end) over pieces of [0, n) no larger than `grain` and
+    // returns once all of them have run. The first exception thrown by f is
+    // rethrown here, after every piece has finished.
+    template <class F>
+    void parallel_for(size_t n, size_t grain, F&& f) {
+        grain = std::max<size_t>(grain, 1);
+        if (n <= grain || size() == 1) {
+            if (n) f(size_t{0}, n);
+            return;
+        }
+        std::atomic<size_t> done{0};
+        std::mutex err_mu;
+        std::exception_ptr err;
+        std::function<void(size_t, size_t)> run = [&](size_t lo, size_t hi) {
+            while (hi - lo > grain) {
+                size_t mid = lo + (hi - lo) / 2;
+                push([&run, mid, hi] { run(mid, hi); });
+                hi = mid;
+            }
+            try {
+                f(lo, hi);
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(err_mu);
+                if (!err) err = std::current_exception();
+            }
+            done.fetch_add(hi - lo, std::memory_order_acq_rel);
+        };
+        run(0, n);
+        size_t me = self();
+        while (done.load(std::memory_order_acquire) < n)
+            if (!try_run(me)) std::this_thread::yield();
+        if (err) std::rethrow_exception(err);
+    }
+
+private:
+    using Task = std::function<void()>;
+    struct alignas(64) Queue {
+        std::mutex mu;
+        std::deque<Task> tasks;
+    };
+
+    size_t self() const { return tl_pool == this ? tl_index : 0; }
+
+    void push(Task t) {
+        Queue& q = queues[self()];
+        {
+            std::lock_guard<std::mutex> lk(q.mu);
+            q.tasks.push_back(std::move(t));
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lk(idle_mu);
+        }
+        idle_cv.notify_one();
+    }
+
+    bool try_run(size_t me) {
+        Task t;
+        for (size_t k = 0; k < queues.size() && !t; ++k) {
+            Queue& q = queues[(me + k) % queues.size()];
+            std::lock_guard<std::mutex> lk(q.mu);
+            if (q.tasks.empty()) continue;
+            if (k == 0) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+        }
+        if (!t) return false;
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        t();
+        return true;
+    }
+
+    void run_worker(size_t i) {
+        tl_pool = this;
+        tl_index = i;
+        while (true) {
+            if (try_run(i)) continue;
+            std::unique_lock<std::mutex> lk(idle_mu);
+            idle_cv.wait(lk, [&] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            if (stopping && queued.load() == 0) return;
+        }
+    }
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::mutex idle_mu;
+    std::condition_variable idle_cv;
+    bool stopping{false};
+
+    static inline thread_local const TaskPool* tl_pool = nullptr;
+    static inline thread_local size_t tl_index = 0;
+};
+
+// The pool shared by save, load and verify; sized by set_task_threads().
+TaskPool& task_pool();
+
+// Not safe while a parallel_for is running.
+void set_task_threads(unsigned n);
+
+// ---- latency statistics ----
+// Build with VCS_STATS=0 to compile the instrumentation out.
+
+#ifndef VCS_STATS
+#define VCS_STATS 1
+#endif
+
+// Log-linear histogram of nanosecond latencies in the style of HdrHistogram.
+// Values below 2*kSub are counted exactly; above that every power of two is
+// split into kSub buckets, so a reported percentile is within 1/kSub (6%) of
+// the true value. Recording is a relaxed atomic add, safe from any thread.
+class LatencyHistogram {
+public:
+    static constexpr size_t kSub = 16;
+    static constexpr size_t kBuckets = 61 * kSub;   // the last one holds 2^64 - 1
+
+    struct Summary {
+        uint64_t count{};          // calls, counting each sample with its weight
+        bool     estimated{};      // some samples stood for several calls
+        uint64_t p50{}, p90{}, p99{}, max{};
+    };
+
+    explicit LatencyHistogram(std::string name) : name_(std::move(name)) {}
+
+    const std::string& name() const { return name_; }
+
+    // A sample with weight w stands for w calls of similar cost.
+    void record(uint64_t ns, uint32_t weight = 1) {
+        counts[bucket(ns)].fetch_add(weight, std::memory_order_relaxed);
+        if (weight > 1 && !sampled.load(std::memory_order_relaxed)) sampled.store(true, std::memory_order_relaxed);
+        uint64_t m = max_ns.load(std::memory_order_relaxed);
+        while (ns > m && !max_ns.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+    }
+
+    // Percentiles are the upper bound of the bucket they fall in, capped at
+    // the largest sample.
+    Summary summary() const;
+
+    // Samples recorded concurrently may survive it.
+    void reset();
+
+    static size_t bucket(uint64_t ns) {
+        if (ns < 2 * kSub) return size_t(ns);
+        int shift = std::bit_width(ns) - 5;     // keeps the top five bits: 1xxxx
+        return size_t(shift) * kSub + size_t(ns >> shift);
+    }
+
+    static uint64_t bucket_high(size_t i) {
+        if (i < 2 * kSub) return i;
+        int shift = int(i / kSub) - 1;
+        uint64_t low = uint64_t(i % kSub + kSub) << shift;
+        return low + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    std::string name_;
+    std::array<std::atomic<uint64_t>, kBuckets> counts{};
+    std::atomic<uint64_t> max_ns{};
+    std::atomic<bool> sampled{};
+};
+
+// The histogram called `name`, created on first use. Histograms live for the
+// rest of the program.
+LatencyHistogram& latency_histogram(std::string_view name);
+
+// Every histogram, in the order they were created.
+std::vector<const LatencyHistogram*> latency_histograms();
+
+void reset_latency_histograms();
+
+// Sampling state of one call site on one thread. Reading the clock twice
+// costs tens of nanoseconds, as much as a cheap call itself: after a call
+// faster than kTimeAllNs, the next kPeriod - 1 calls are skipped and the
+// following timed call counts for all of them. Slower calls are all timed.
+struct LatencySampler {
+    static constexpr uint64_t kTimeAllNs = 10000;
+    static constexpr uint32_t kPeriod = 128;
+
+    uint32_t skip{};
+    uint32_t weight{1};
+};
+
+// Times the enclosing scope into `hist` unless the sampler skips this call;
+// a skipped call costs a decrement.
+class LatencyTimer {
+public:
+    LatencyTimer(LatencyHistogram& h, LatencySampler& s) {
+        if (s.skip) {
+            --s.skip;
+            return;
+        }
+        hist = &h;
+        sampler = &s;
+        t0 = std::chrono::steady_clock::now();
+    }
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+    ~LatencyTimer() {
+        if (!hist) return;
+        uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+        hist->record(ns, sampler->weight);
+        sampler->weight = ns >= LatencySampler::kTimeAllNs ? 1 : LatencySampler::kPeriod;
+        sampler->skip = sampler->weight - 1;
+    }
+
+private:
+    LatencyHistogram* hist{};
+    LatencySampler* sampler{};
+    std::chrono::steady_clock::time_point t0;
+};
+
+// VCS_LATENCY("name") at the top of a function times its calls.
+#if VCS_STATS
+#define VCS_LATENCY(name)                                                                      \
+    static ::vcs::LatencyHistogram& vcs_latency_hist = ::vcs::latency_histogram(name);         \
+    static thread_local ::vcs::LatencySampler vcs_latency_sampler;                              \
+    ::vcs::LatencyTimer vcs_latency_timer(vcs_latency_hist, vcs_latency_sampler)
+#else
+#define VCS_LATENCY(name) ((void)0)
+#endif
+
+// ---- line diff ----
+
+// Lines of s, each keeping its trailing '\n' (the last one may lack it).
+std::vector<std::string_view> split_lines(std::string_view s);
+
+// Lines [a, a+a_len) of the old text are replaced by lines [b, b+b_len) of the new one.
+struct DiffChange {
+    size_t a{}, a_len{};
+    size_t b{}, b_len{};
+};
+
+struct LineDiff {
+    std::vector<std::string_view> a_lines, b_lines;   // lines keep their trailing '\n'
+    std::vector<DiffChange>  changes;
+};
+
+// Line diff of a against b; the result's views point into a and b.
+LineDiff diff_lines(std::string_view a, std::string_view b);
+
+// ---- memory accounting ----
+// Heap estimates for `stats mem`. The allocator's own per-block overhead is
+// not known here and not counted.
+
+// The heap block of a string; 0 while it fits in the string object itself.
+inline size_t heap_bytes(const std::string& s) {
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+// Nodes (payload plus a next pointer) and buckets of a node-based hash map,
+// without whatever the mapped values own.
+template <class M>
+size_t hash_map_bytes(const M& m) {
+    return m.size() * (sizeof(typename M::value_type) + sizeof(void*)) + m.bucket_count() * sizeof(void*);
+}
+
+// Posting lists of byte trigrams -> versions containing them.  Versions are only
+// ever appended, so every list stays sorted by id without extra work.
+struct TrigramIndex {
+    std::unordered_map<uint32_t, std::vector<VersionId>> postings;
+    VersionId indexed_upto{0};
+
+    static uint32_t gram(const char* p) {
+        return (uint32_t(uint8_t(p[0])) << 16) | (uint32_t(uint8_t(p[1])) << 8) | uint8_t(p[2]);
+    }
+
+    static std::vector<uint32_t> distinct_grams(std::string_view s) {
+        std::vector<uint32_t> out;
+        if (s.size() < 3) return out;
+        if (s.size() <= (1u << 16)) {
+            out.reserve(s.size() - 2);
+            for (size_t i = 0; i + 3 <= s.size(); ++i) out.push_back(gram(s.data() + i));
+            std::sort(out.begin(), out.end());
+            out.erase(std::unique(out.begin(), out.end()), out.end());
+            return out;
+        }
+        // large documents: a 2 MiB bitmap over the 2^24 possible grams beats sorting
+        std::vector<uint64_t> bits(size_t(1) << 18);
+        for (size_t i = 0; i + 3 <= s.size(); ++i) {
+            uint32_t g = gram(s.data() + i);
+            bits[g >> 6] |= uint64_t(1) << (g & 63);
+        }
+        for (size_t w = 0; w < bits.size(); ++w)
+            for (uint64_t m = bits[w]; m; m &= m - 1)
+                out.push_back(uint32_t(w * 64 + std::countr_zero(m)));
+        return out;
+    }
+
+    void add(VersionId id, std::string_view content) {
+        for (uint32_t g : distinct_grams(content)) postings[g].push_back(id);
+        indexed_upto = std::max(indexed_upto, id);
+    }
+
+    size_t memory_bytes() const {
+        size_t n = hash_map_bytes(postings);
+        for (const auto& [g, ids] : postings) n += ids.capacity() * sizeof(VersionId);
+        return n;
+    }
+
+    void clear() {
+        postings.clear();
+        indexed_upto = 0;
+    }
+
+    // Versions that may contain the pattern, ascending; nullopt when the pattern
+    // is too short to be filtered and every version is a candidate.
+    std::optional<std::vector<VersionId>> candidates(std::string_view pattern) const {
+        if (pattern.size() < 3) return std::nullopt;
+        std::vector<const std::vector<VersionId>*> lists;
+        for (uint32_t g : distinct_grams(pattern)) {
+            auto it = postings.find(g);
+            if (it == postings.end()) return std::vector<VersionId>{};
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](auto* a, auto* b) { return a->size() < b->size(); });
+        std::vector<VersionId> out = *lists.front(), tmp;
+        for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+            tmp.clear();
+            std::set_intersection(out.begin(), out.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(tmp));
+            out.swap(tmp);
+        }
+        return out;
+    }
+
+    // "trigrams UPTO N" then one line per gram: "GRAM COUNT delta..."
+    void save(std::ostream& os) const {
+        os << "trigrams " << indexed_upto << " " << postings.size() << "\n";
+        for (const auto& [g, ids] : postings) {
+            os << g << " " << ids.size();
+            VersionId prev = 0;
+            for (VersionId id : ids) { os << " " << (id - prev); prev = id; }
+            os << "\n";
+        }
+    }
+
+    bool load(std::istream& is) {
+        clear();
+        size_t n = 0;
+        if (!(is >> indexed_upto >> n)) return false;
+        postings.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t g{};
+            size_t cnt{};
+            if (!(is >> g >> cnt)) return false;
+            auto& ids = postings[g];
+            ids.resize(cnt);
+            VersionId prev = 0;
+            for (auto& id : ids) {
+                // deltas keep the list strictly ascending and within indexed_upto
+                if (!(is >> id) || id == 0 || id > indexed_upto - prev) return false;
+                id += prev;
+                prev = id;
+            }
+        }
+        return true;
+    }
+};
+
+// Blame's line origins (version -> commit that introduced each of its lines)
+// within a byte budget. Between calls only every kStride-th version of a
+// first-parent chain is kept, plus the versions blamed directly; a blame
+// recomputes from the nearest kept ancestors. Once the budget is exceeded
+// the oldest entries go first. Versions never change, so entries stay
+// valid until the history is replaced by load().
+struct BlameCache {
+    static constexpr uint64_t kStride = 64;
+    static constexpr size_t kBudget = size_t{64} << 20;
+
+    std::unordered_map<VersionId, std::vector<VersionId>> origins;
+    std::deque<VersionId> order;       // insertion order, oldest first
+    size_t bytes{};
+
+    const std::vector<VersionId>* find(VersionId id) const {
+        auto it = origins.find(id);
+        return it == origins.end() ? nullptr : &it->second;
+    }
+
+    void insert(VersionId id, std::vector<VersionId> o) {
+        bytes += o.capacity() * sizeof(VersionId);
+        if (origins.try_emplace(id, std::move(o)).second) order.push_back(id);
+    }
+
+    // Evicts oldest first down to the budget, but never `keep`.
+    void trim(VersionId keep) {
+        while (bytes > kBudget && order.size() > 1) {
+            VersionId id = order.front();
+            order.pop_front();
+            if (id == keep) {
+                order.push_back(id);
+                continue;
+            }
+            auto it = origins.find(id);
+            bytes -= it->second.capacity() * sizeof(VersionId);
+            origins.erase(it);
+        }
+    }
+
+    void clear() {
+        origins.clear();
+        order.clear();
+        bytes = 0;
+    }
+
+    size_t memory_bytes() const { return hash_map_bytes(origins) + order.size() * sizeof(VersionId) + bytes; }
+};
+
+// content_hash -> newest version with that content, plus the distinct hashes in
+// sorted order for hex-prefix lookups.  New hashes collect in a small unsorted
+// tail that is merged in once it fills, so commits never shift the whole array.
+struct HashIndex {
+    std::unordered_map<uint64_t, VersionId> latest;
+    std::vector<uint64_t> sorted;
+    std::vector<uint64_t> pending;
+
+    static constexpr size_t kPending = 1024;
+
+    size_t memory_bytes() const {
+        return hash_map_bytes(latest) + (sorted.capacity() + pending.capacity()) * sizeof(uint64_t);
+    }
+
+    void add(uint64_t h, VersionId id) {
+        auto [it, fresh] = latest.try_emplace(h, id);
+        it->second = id;
+        if (!fresh) return;
+        pending.push_back(h);
+        if (pending.size() >= kPending) flush();
+    }
+
+    void flush() {
+        std::sort(pending.begin(), pending.end());
+        size_t mid = sorted.size();
+        sorted.insert(sorted.end(), pending.begin(), pending.end());
+        std::inplace_merge(sorted.begin(), sorted.begin() + mid, sorted.end());
+        pending.clear();
+    }
+
+    void clear() {
+        latest.clear();
+        sorted.clear();
+        pending.clear();
+    }
+
+    // O(1): newest version whose content hashes to h, 0 if the content never existed.
+    VersionId find(uint64_t h) const {
+        auto it = latest.find(h);
+        return it == latest.end() ? 0 : it->second;
+    }
+
+    // Distinct hashes whose 16-digit hex form starts with the `digits` hex digits
+    // of `prefix`; stops after `max` hits.
+    std::vector<uint64_t> match_prefix(uint64_t prefix, unsigned digits, size_t max) const {
+        unsigned shift = 4 * (16 - digits);
+        uint64_t lo = shift == 64 ? 0 : prefix << shift;
+        uint64_t hi = shift == 64 ? UINT64_MAX : lo | ((uint64_t(1) << shift) - 1);
+        std::vector<uint64_t> out;
+        for (auto it = std::lower_bound(sorted.begin(), sorted.end(), lo); it != sorted.end() && *it <= hi && out.size() < max; ++it)
+            out.push_back(*it);
+        for (uint64_t h : pending)
+            if (h >= lo && h <= hi && out.size() < max) out.push_back(h);
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+};
+
+// Compressed set of version ids in the style of Roaring bitmaps: ids are grouped
+// by their high bits into 65536-wide chunks, each kept in the smallest of three
+// forms: a sorted array while sparse, runs of consecutive ids, or a plain
+// bitmap. Ancestry sets are mostly long runs, so a dense branch costs a few
+// bytes per chunk rather than 8 KiB.
+class RoaringBitmap {
+public:
+    bool empty() const { return chunks.empty(); }
+
+    bool contains(uint64_t x) const {
+        auto it = find_chunk(x >> 16);
+        return it != chunks.end() && it->key == (x >> 16) && it->contains(uint16_t(x));
+    }
+
+    void add(uint64_t x) {
+        uint64_t key = x >> 16;
+        auto it = (!chunks.empty() && chunks.back().key == key) ? chunks.end() - 1 : find_chunk(key);
+        if (it == chunks.end() || it->key != key) {
+            Chunk c;
+            c.key = key;
+            it = chunks.insert(it, std::move(c));
+        }
+        it->add(uint16_t(x));
+    }
+
+    void union_with(const RoaringBitmap& o) {
+        std::vector<Chunk> out;
+        out.reserve(chunks.size() + o.chunks.size());
+        auto a = chunks.begin();
+        auto b = o.chunks.begin();
+        while (a != chunks.end() || b != o.chunks.end()) {
+            if (b == o.chunks.end() || (a != chunks.end() && a->key < b->key)) {
+                out.push_back(std::move(*a++));
+            } else if (a == chunks.end() || b->key < a->key) {
+                out.push_back(*b++);
+            } else {
+                a->union_with(*b++);
+                out.push_back(std::move(*a++));
+            }
+        }
+        chunks = std::move(out);
+    }
+
+    // Converts every chunk to its smallest form. Adds only convert a chunk
+    // when it outgrows its form, so bulk updates call this once at the end.
+    void optimize() {
+        for (auto& c : chunks) c.optimize();
+    }
+
+    // Largest id in the set, 0 when empty.
+    uint64_t max() const {
+        if (chunks.empty()) return 0;
+        const Chunk& c = chunks.back();
+        return (c.key << 16) | c.last();
+    }
+
+    uint64_t cardinality() const {
+        uint64_t n = 0;
+        for (const auto& c : chunks) n += c.card;
+        return n;
+    }
+
+    template <class F>
+    void for_each(F&& f) const {
+        for (const auto& c : chunks) {
+            uint64_t base = c.key << 16;
+            c.for_each([&](uint16_t v) { f(base | v); });
+        }
+    }
+
+    size_t memory_bytes() const {
+        size_t n = chunks.capacity() * sizeof(Chunk);
+        for (const auto& c : chunks)
+            n += c.array.capacity() * sizeof(uint16_t) + c.bits.capacity() * sizeof(uint64_t) +
+                 c.runs.capacity() * sizeof(Run);
+        return n;
+    }
+
+    // "N" then per chunk "KEY a COUNT v...", "KEY r COUNT first last..." or
+    // "KEY b w0..w1023" (words in hex)
+    void save(std::ostream& os) const {
+        os << chunks.size();
+        for (const auto& c : chunks) {
+            os << " " << c.key;
+            if (c.kind == Chunk::array_kind) {
+                os << " a " << c.array.size();
+                for (uint16_t v : c.array) os << " " << v;
+            } else if (c.kind == Chunk::run_kind) {
+                os << " r " << c.runs.size();
+                for (Run r : c.runs) os << " " << r.first << " " << r.last;
+            } else {
+                os << " b" << std::hex;
+                for (uint64_t w : c.bits) os << " " << w;
+                os << std::dec;
+            }
+        }
+    }
+
+    bool load(std::istream& is) {
+        chunks.clear();
+        size_t n = 0;
+        if (!(is >> n)) return false;
+        for (size_t i = 0; i < n; ++i) {
+            Chunk c;
+            char kind = 0;
+            if (!(is >> c.key >> kind)) return false;
+            if (kind == 'a') {
+                size_t cnt = 0;
+                if (!(is >> cnt) || cnt > kArrayMax) return false;
+                c.array.resize(cnt);
+                for (auto& v : c.array) if (!(is >> v)) return false;
+                if (std::adjacent_find(c.array.begin(), c.array.end(), std::greater_equal<>()) != c.array.end()) return false;
+                c.card = static_cast<uint32_t>(cnt);
+            } else if (kind == 'r') {
+                size_t cnt = 0;
+                if (!(is >> cnt) || cnt > kRunMax) return false;
+                c.kind = Chunk::run_kind;
+                c.runs.resize(cnt);
+                for (size_t k = 0; k < cnt; ++k) {
+                    Run& r = c.runs[k];
+                    // sorted, disjoint and not touching the previous run
+                    if (!(is >> r.first >> r.last) || r.last < r.first || (k && r.first <= c.runs[k - 1].last + 1))
+                        return false;
+                    c.card += uint32_t(r.last - r.first) + 1;
+                }
+            } else if (kind == 'b') {
+                c.kind = Chunk::bitmap_kind;
+                c.bits.resize(1024);
+                for (auto& w : c.bits) if (!(is >> std::hex >> w)) { is >> std::dec; return false; }
+                is >> std::dec;
+                for (uint64_t w : c.bits) c.card += static_cast<uint32_t>(std::popcount(w));
+            } else {
+                return false;
+            }
+            if (c.card == 0 || (!chunks.empty() && chunks.back().key >= c.key)) return false;
+            c.optimize();
+            chunks.push_back(std::move(c));
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint32_t kArrayMax = 4096;   // 8 KiB, the size of a bitmap
+    static constexpr size_t   kRunMax   = 2048;   // likewise
+
+    struct Run {
+        uint16_t first, last;                     // inclusive
+    };
+
+    struct Chunk {
+        enum Kind : uint8_t { array_kind, run_kind, bitmap_kind };
+
+        uint64_t key{};
+        uint32_t card{};
+        Kind kind{array_kind};
+        std::vector<uint16_t> array;   // sorted
+        std::vector<Run> runs;         // sorted, disjoint and never adjacent
+        std::vector<uint64_t> bits;    // 1024 words
+
+        bool contains(uint16_t v) const {
+            if (kind == bitmap_kind) return (bits[v >> 6] >> (v & 63)) & 1;
+            if (kind == array_kind) return std::binary_search(array.begin(), array.end(), v);
+            auto it = std::upper_bound(runs.begin(), runs.end(), v, [](uint16_t x, const Run& r) { return x < r.first; });
+            return it != runs.begin() && std::prev(it)->last >= v;
+        }
+
+        uint16_t last() const {
+            if (kind == array_kind) return array.back();
+            if (kind == run_kind) return runs.back().last;
+            size_t w = bits.size() - 1;
+            while (w && !bits[w]) --w;
+            return uint16_t(w * 64 + 63 - std::countl_zero(bits[w]));
+        }
+
+        void add(uint16_t v) {
+            if (kind == bitmap_kind) {
+                uint64_t& w = bits[v >> 6];
+                uint64_t m = uint64_t(1) << (v & 63);
+                if (!(w & m)) { w |= m; ++card; }
+                return;
+            }
+            if (kind == run_kind) {
+                add_to_runs(v);
+                return;
+            }
+            auto it = (array.empty() || array.back() < v) ? array.end() : std::lower_bound(array.begin(), array.end(), v);
+            if (it != array.end() && *it == v) return;
+            array.insert(it, v);
+            if (++card > kArrayMax) optimize();
+        }
+
+        // Extends or joins the neighbouring runs when v touches them.
+        void add_to_runs(uint16_t v) {
+            auto it = std::upper_bound(runs.begin(), runs.end(), v, [](uint16_t x, const Run& r) { return x < r.first; });
+            if (it != runs.begin()) {
+                Run& p = *std::prev(it);
+                if (p.last >= v) return;
+                if (p.last + 1 == v) {
+                    p.last = v;
+                    ++card;
+                    if (it != runs.end() && it->first == v + 1) {
+                        p.last = it->last;
+                        runs.erase(it);
+                    }
+                    return;
+                }
+            }
+            ++card;
+            if (it != runs.end() && it->first == v + 1) {
+                it->first = v;
+                return;
+            }
+            runs.insert(it, Run{v, v});
+            if (runs.size() > kRunMax) optimize();
+        }
+
+        template <class F>
+        void for_each(F&& f) const {
+            if (kind == array_kind) {
+                for (uint16_t v : array) f(v);
+            } else if (kind == run_kind) {
+                for (Run r : runs)
+                    for (uint32_t v = r.first; v <= r.last; ++v) f(uint16_t(v));
+            } else {
+                for (size_t w = 0; w < bits.size(); ++w)
+                    for (uint64_t m = bits[w]; m; m &= m - 1) f(uint16_t(w * 64 + std::countr_zero(m)));
+            }
+        }
+
+        template <class F>
+        void for_each_run(F&& f) const {
+            if (kind == run_kind) {
+                for (Run r : runs) f(r);
+                return;
+            }
+            std::optional<Run> open;
+            for_each([&](uint16_t v) {
+                if (open && open->last + 1 == v) {
+                    open->last = v;
+                    return;
+                }
+                if (open) f(*open);
+                open = Run{v, v};
+            });
+            if (open) f(*open);
+        }
+
+        size_t count_runs() const {
+            if (kind == run_kind) return runs.size();
+            size_t n = 0;
+            if (kind == array_kind) {
+                for (size_t i = 0; i < array.size(); ++i) n += (i == 0 || array[i] != array[i - 1] + 1);
+                return n;
+            }
+            // a run starts at every set bit whose lower neighbour is clear
+            uint64_t carry = 0;
+            for (uint64_t w : bits) {
+                n += std::popcount(w & ~((w << 1) | carry));
+                carry = w >> 63;
+            }
+            return n;
+        }
+
+        void optimize() {
+            size_t run_bytes = count_runs() * sizeof(Run);
+            size_t other_bytes = card <= kArrayMax ? card * sizeof(uint16_t) : 1024 * sizeof(uint64_t);
+            convert(run_bytes < other_bytes ? run_kind : card <= kArrayMax ? array_kind : bitmap_kind);
+        }
+
+        void convert(Kind to) {
+            if (to == kind) return;
+            std::vector<uint16_t> a;
+            std::vector<Run> r;
+            std::vector<uint64_t> b;
+            if (to == array_kind) {
+                a.reserve(card);
+                for_each([&](uint16_t v) { a.push_back(v); });
+            } else if (to == run_kind) {
+                for_each_run([&](Run x) { r.push_back(x); });
+            } else {
+                b.assign(1024, 0);
+                for_each([&](uint16_t v) { b[v >> 6] |= uint64_t(1) << (v & 63); });
+            }
+            array = std::move(a);
+            runs = std::move(r);
+            bits = std::move(b);
+            kind = to;
+        }
+
+        void union_with(const Chunk& o) {
+            if (kind == array_kind && o.kind == array_kind) {
+                std::vector<uint16_t> merged;
+                merged.reserve(array.size() + o.array.size());
+                std::set_union(array.begin(), array.end(), o.array.begin(), o.array.end(), std::back_inserter(merged));
+                array = std::move(merged);
+                card = static_cast<uint32_t>(array.size());
+            } else if (kind != bitmap_kind && o.kind != bitmap_kind) {
+                // merge both as runs, ordered by their first id
+                std::vector<Run> mine, theirs, merged;
+                for_each_run([&](Run r) { mine.push_back(r); });
+                o.for_each_run([&](Run r) { theirs.push_back(r); });
+                merged.reserve(mine.size() + theirs.size());
+                auto a = mine.begin(), b = theirs.begin();
+                while (a != mine.end() || b != theirs.end()) {
+                    Run r = (b == theirs.end() || (a != mine.end() && a->first < b->first)) ? *a++ : *b++;
+                    if (!merged.empty() && r.first <= merged.back().last + 1)
+                        merged.back().last = std::max(merged.back().last, r.last);
+                    else
+                        merged.push_back(r);
+                }
+                array.clear();
+                array.shrink_to_fit();
+                runs = std::move(merged);
+                kind = run_kind;
+                card = 0;
+                for (Run r : runs) card += uint32_t(r.last - r.first) + 1;
+            } else {
+                convert(bitmap_kind);
+                if (o.kind == bitmap_kind) {
+                    for (size_t w = 0; w < bits.size(); ++w) bits[w] |= o.bits[w];
+                } else {
+                    o.for_each([&](uint16_t v) { bits[v >> 6] |= uint64_t(1) << (v & 63); });
+                }
+                card = 0;
+                for (uint64_t w : bits) card += static_cast<uint32_t>(std::popcount(w));
+            }
+            optimize();
+        }
+    };
+
+    std::vector<Chunk> chunks;   // sorted by key
+
+    std::vector<Chunk>::const_iterator find_chunk(uint64_t key) const {
+        return std::lower_bound(chunks.begin(), chunks.end(), key, [](const Chunk& c, uint64_t k) { return c.key < k; });
+    }
+    std::vector<Chunk>::iterator find_chunk(uint64_t key) {
+        return std::lower_bound(chunks.begin(), chunks.end(), key, [](const Chunk& c, uint64_t k) { return c.key < k; });
+    }
+};
+
+// Name-keyed map kept as a list of short sorted runs: ordered iteration,
+// contiguous prefix ranges and string_view lookups without building a
+// std::string or a heap node per entry.  Lookups are O(log n); an insert
+// shifts at most one run and splits it once it doubles.
+template <class V>
+class FlatMap {
+    static constexpr size_t kRun = 256;
+
+public:
+    using Entry      = std::pair<std::string, V>;
+    using value_type = Entry;
+
+    template <bool Const>
+    class Iter {
+        using Runs = std::conditional_t<Const, const std::vector<std::vector<Entry>>, std::vector<std::vector<Entry>>>;
+        Runs* runs{};
+        size_t r{}, i{};
+        friend class FlatMap;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type   = ptrdiff_t;
+        using value_type        = Entry;
+        using reference         = std::conditional_t<Const, const Entry&, Entry&>;
+        using pointer           = std::conditional_t<Const, const Entry*, Entry*>;
+
+        Iter() = default;
+        Iter(Runs* rs, size_t run, size_t idx) : runs(rs), r(run), i(idx) {}
+        operator Iter<true>() const { return {runs, r, i}; }
+
+        reference operator*() const { return (*runs)[r][i]; }
+        pointer operator->() const { return &(*runs)[r][i]; }
+        Iter& operator++() {
+            if (++i == (*runs)[r].size()) { ++r; i = 0; }
+            return *this;
+        }
+        Iter operator++(int) { Iter t = *this; ++*this; return t; }
+        bool operator==(const Iter& o) const { return r == o.r && i == o.i; }
+    };
+    using iterator       = Iter<false>;
+    using const_iterator = Iter<true>;
+
+    iterator begin() { return {&runs, 0, 0}; }
+    iterator end() { return {&runs, runs.size(), 0}; }
+    const_iterator begin() const { return {&runs, 0, 0}; }
+    const_iterator end() const { return {&runs, runs.size(), 0}; }
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    void clear() { runs.clear(); count_ = 0; }
+
+    // Entries and key strings, without whatever the values own.
+    size_t memory_bytes() const {
+        size_t n = runs.capacity() * sizeof(std::vector<Entry>);
+        for (const auto& run : runs) {
+            n += run.capacity() * sizeof(Entry);
+            for (const Entry& e : run) n += heap_bytes(e.first);
+        }
+        return n;
+    }
+
+    iterator find(std::string_view k) {
+        auto [r, i] = lower(k);
+        return (r < runs.size() && runs[r][i].first == k) ? iterator{&runs, r, i} : end();
+    }
+    const_iterator find(std::string_view k) const {
+        auto [r, i] = lower(k);
+        return (r < runs.size() && runs[r][i].first == k) ? const_iterator{&runs, r, i} : end();
+    }
+    size_t count(std::string_view k) const { return find(k) != end(); }
+
+    V& operator[](std::string_view k) {
+        auto [r, i] = lower(k);
+        if (r < runs.size() && runs[r][i].first == k) return runs[r][i].second;
+        if (runs.empty()) runs.emplace_back();
+        if (r == runs.size()) { r = runs.size() - 1; i = runs[r].size(); }
+        auto& run = runs[r];
+        run.emplace(run.begin() + i, std::string(k), V{});
+        ++count_;
+        if (run.size() >= 2 * kRun) {
+            runs.emplace(runs.begin() + r + 1, std::make_move_iterator(run.begin() + kRun), std::make_move_iterator(run.end()));
+            runs[r].resize(kRun);
+            if (i >= kRun) { ++r; i -= kRun; }
+        }
+        return runs[r][i].second;
+    }
+    V& at(std::string_view k) {
+        auto it = find(k);
+        if (it == end()) throw std::out_of_range("FlatMap::at");
+        return it->second;
+    }
+    const V& at(std::string_view k) const {
+        auto it = find(k);
+        if (it == end()) throw std::out_of_range("FlatMap::at");
+        return it->second;
+    }
+
+    iterator erase(iterator it) {
+        auto& run = runs[it.r];
+        run.erase(run.begin() + it.i);
+        --count_;
+        if (run.empty()) {
+            runs.erase(runs.begin() + it.r);
+            return {&runs, it.r, 0};
+        }
+        return it.i == run.size() ? iterator{&runs, it.r + 1, 0} : it;
+    }
+    size_t erase(std::string_view k) {
+        auto it = find(k);
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+
+    // All entries whose key starts with p.
+    std::pair<const_iterator, const_iterator> prefix(std::string_view p) const {
+        auto [r, i] = lower(p);
+        const_iterator lo{&runs, r, i}, hi = lo;
+        while (hi != end() && hi->first.starts_with(p)) ++hi;
+        return {lo, hi};
+    }
+
+private:
+    std::vector<std::vector<Entry>> runs;   // each sorted and non-empty, in key order
+    size_t count_{0};
+
+    // Position of the first key >= k, (runs.size(), 0) if none.
+    std::pair<size_t, size_t> lower(std::string_view k) const {
+        size_t r = std::partition_point(runs.begin(), runs.end(),
+                                   [&](const std::vector<Entry>& run) { return run.back().first < k; }) - runs.begin();
+        if (r == runs.size()) return {r, 0};
+        const auto& run = runs[r];
+        size_t i = std::lower_bound(run.begin(), run.end(), k,
+                               [](const Entry& e, std::string_view key) { return e.first < key; }) - run.begin();
+        return {r, i};
+    }
+};
+
+// Append-only vector made of fixed-size chunks that are never moved or resized,
+// so an element keeps its address until clear(). Appends never copy old
+// elements, so their cost does not grow with the size. One writer may append
+// while other threads read any index below a size() they have loaded: the
+// length is published with a release store after the element is constructed.
+template <class T, size_t ChunkBits = 12>
+class SegmentedVector {
+    static constexpr size_t kChunk = size_t{1} << ChunkBits;
+    static constexpr size_t kDirBits = 10;
+    static constexpr size_t kDir = size_t{1} << kDirBits;   // chunks per directory block
+    static constexpr size_t kTop = 1024;                    // directory blocks
+
+    struct Chunk {
+        alignas(T) unsigned char raw[kChunk * sizeof(T)];
+        T* at(size_t i) { return reinterpret_cast<T*>(raw) + i; }
+    };
+    struct Dir { Chunk* chunks[kDir]{}; };
+
+public:
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+        const_iterator() = default;
+        reference operator*() const { return (*owner)[i]; }
+        pointer operator->() const { return &(*owner)[i]; }
+        const_iterator& operator++() { ++i; return *this; }
+        const_iterator operator++(int) { auto t = *this; ++i; return t; }
+        bool operator==(const const_iterator& o) const { return i == o.i; }
+    private:
+        friend class SegmentedVector;
+        const_iterator(const SegmentedVector* o, size_t k) : owner(o), i(k) {}
+        const SegmentedVector* owner{};
+        size_t i{};
+    };
+
+    SegmentedVector() = default;
+    SegmentedVector(const SegmentedVector&) = delete;
+    SegmentedVector& operator=(const SegmentedVector&) = delete;
+    ~SegmentedVector() { clear(); }
+
+    size_t size() const { return len.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    // Chunks and directory blocks allocated so far, without whatever the
+    // elements own.
+    size_t memory_bytes() const {
+        size_t chunks = (size() + kChunk - 1) >> ChunkBits;
+        return chunks * sizeof(Chunk) + ((chunks + kDir - 1) >> kDirBits) * sizeof(Dir);
+    }
+
+    T& operator[](size_t i) { return *slot(i); }
+    const T& operator[](size_t i) const { return *const_cast<SegmentedVector*>(this)->slot(i); }
+    T& back() { return (*this)[size() - 1]; }
+    const T& back() const { return (*this)[size() - 1]; }
+
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, size()}; }
+
+    template <class... A>
+    T& emplace_back(A&&... args) {
+        size_t n = len.load(std::memory_order_relaxed);
+        size_t c = n >> ChunkBits;
+        if ((n & (kChunk - 1)) == 0) {
+            if (c >= kTop * kDir) throw std::length_error("SegmentedVector: capacity exceeded");
+            Dir*& d = top[c >> kDirBits];
+            if (!d) d = new Dir;
+            d->chunks[c & (kDir - 1)] = new Chunk;
+        }
+        T* p = new (top[c >> kDirBits]->chunks[c & (kDir - 1)]->at(n & (kChunk - 1)))
+            T(std::forward<A>(args)...);
+        len.store(n + 1, std::memory_order_release);
+        return *p;
+    }
+    void push_back(T v) { emplace_back(std::move(v)); }
+
+    // Not safe against concurrent readers.
+    void clear() {
+        size_t n = len.load(std::memory_order_relaxed);
+        len.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < n; ++i) slot(i)->~T();
+        for (Dir*& d : top) {
+            if (!d) continue;
+            for (Chunk* c : d->chunks) delete c;
+            delete d;
+            d = nullptr;
+        }
+    }
+
+private:
+    T* slot(size_t i) {
+        return top[i >> (ChunkBits + kDirBits)]->chunks[(i >> ChunkBits) & (kDir - 1)]->at(i & (kChunk - 1));
+    }
+
+    std::array<Dir*, kTop> top{};
+    std::atomic<size_t> len{0};
+};
+
+// Text with a gap at the last edit. An edit first moves the gap to its
+// position, copying only the bytes between the two, then deletes by widening
+// the gap and inserts by filling it. Edits close to the previous one, such as
+// the undo of the last edit, cost O(edit size) however long the text is.
+// view() returns the text in one piece by moving the gap to the end.
+class GapBuffer {
+public:
+    size_t size() const { return buf.size() - gap_len; }
+    bool empty() const { return size() == 0; }
+    size_t memory_bytes() const { return heap_bytes(buf); }
+
+    // A copy of the text; unlike view() it leaves the gap alone, so it is
+    // safe to call from concurrent readers.
+    std::string str() const {
+        std::string s(std::string_view(buf).substr(0, gap_at));
+        s += std::string_view(buf).substr(gap_at + gap_len);
+        return s;
+    }
+
+    std::string_view view() {
+        move_gap(size());
+        return std::string_view(buf).substr(0, gap_at);
+    }
+
+    // Moves the gap to pos and returns the at most len bytes that follow it.
+    std::string_view span(size_t pos, size_t len) {
+        move_gap(pos);
+        return std::string_view(buf).substr(gap_at + gap_len, len);
+    }
+
+    // Replaces the at most len bytes at pos <= size() with text.
+    void replace(size_t pos, size_t len, std::string_view text) {
+        move_gap(pos);
+        size_t removed = std::min(len, size() - pos);
+        gap_len += removed;
+        if (text.size() > gap_len) {
+            size_t grow = std::max(text.size() - gap_len, buf.size() / 2);
+            buf.insert(gap_at, grow, '\0');
+            gap_len += grow;
+        }
+        text.copy(buf.data() + gap_at, text.size());
+        gap_at += text.size();
+        gap_len -= text.size();
+    }
+
+    void assign(std::string text) {
+        buf = std::move(text);
+        gap_at = buf.size();
+        gap_len = 0;
+    }
+    void clear() { assign({}); }
+
+private:
+    void move_gap(size_t pos) {
+        if (pos < gap_at)
+            std::memmove(buf.data() + pos + gap_len, buf.data() + pos, gap_at - pos);
+        else if (pos > gap_at)
+            std::memmove(buf.data() + gap_at, buf.data() + gap_at + gap_len, pos - gap_at);
+        gap_at = pos;
+    }
+
+    std::string buf;           // text before the gap, the gap, text after it
+    size_t gap_at{};
+    size_t gap_len{};
+};
+
+struct LogOptions {
+    bool   all{false};
+    bool   reverse{false};
+    size_t limit{SIZE_MAX};
+    int64_t since{INT64_MIN};     // ts_ns bounds, inclusive
+    int64_t until{INT64_MAX};
+};
+
+// Appends s the way `os << std::quoted(s)` writes it.
+void append_quoted(std::string& out, std::string_view s);
+
+// The whole of `s` as a decimal number.
+template <class T>
+bool parse_number(std::string_view s, T& x) {
+    auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), x);
+    return ec == std::errc() && p == s.data() + s.size();
+}
+
+
+// Cursor over saved text that reads like the istream extractors: keys and
+// numbers are separated by whitespace, and quoted strings are in std::quoted
+// form.
+struct TextCursor {
+    std::string_view s;
+    size_t pos{};
+
+    // isspace() in the "C" locale, which is the only one this program uses.
+    static constexpr bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+    void skip_ws() {
+        while (pos < s.size() && is_space(s[pos])) ++pos;
+    }
+
+    bool word(std::string_view& w) {
+        skip_ws();
+        size_t b = pos;
+        while (pos < s.size() && !is_space(s[pos])) ++pos;
+        w = s.substr(b, pos - b);
+        return pos > b;
+    }
+
+    template <class T>
+    bool number(T& x) {
+        skip_ws();
+        auto [p, ec] = std::from_chars(s.data() + pos, s.data() + s.size(), x);
+        if (ec != std::errc()) return false;
+        pos = size_t(p - s.data());
+        return true;
+    }
+
+    bool hex(uint64_t& x) {
+        skip_ws();
+        auto [p, ec] = std::from_chars(s.data() + pos, s.data() + s.size(), x, 16);
+        if (ec != std::errc()) return false;
+        pos = size_t(p - s.data());
+        return true;
+    }
+
+    // Like getline: the rest of the current line, consuming the newline.
+    bool line(std::string_view& l) {
+        if (pos >= s.size()) return false;
+        size_t nl = s.find('\n', pos);
+        if (nl == std::string_view::npos) nl = s.size();
+        l = s.substr(pos, nl - pos);
+        pos = std::min(nl + 1, s.size());
+        return true;
+    }
+
+    // Everything after the current position, as getline would read it.
+    std::string_view rest() {
+        std::string_view r = s.substr(std::min(pos, s.size()));
+        pos = s.size();
+        return r;
+    }
+
+    // A word or a quoted string, as `>> std::quoted(x)` reads it. Escaped
+    // strings are decoded into `scratch`; everything else is a view of `s`.
+    bool quoted(std::string_view& w, std::string& scratch) {
+        skip_ws();
+        if (pos >= s.size() || s[pos] != '"') return word(w);
+        std::string_view raw;
+        if (!quoted_raw(raw)) return false;
+        if (raw.find('\\') == std::string_view::npos) {
+            w = raw;
+        } else {
+            unquote(raw, scratch);
+            w = scratch;
+        }
+        return true;
+    }
+
+    // The still-escaped body of a quoted string; unquote() decodes it.
+    bool quoted_raw(std::string_view& raw) {
+        skip_ws();
+        if (pos >= s.size() || s[pos] != '"') return false;
+        size_t i = pos + 1;
+        while (true) {
+            i = s.find_first_of("\"\\", i);
+            if (i == std::string_view::npos) return false;
+            if (s[i] == '"') break;
+            i += 2;
+        }
+        raw = s.substr(pos + 1, i - pos - 1);
+        pos = i + 1;
+        return true;
+    }
+
+    static void unquote(std::string_view raw, std::string& out) {
+        out.clear();
+        out.reserve(raw.size());
+        for (size_t i = 0; i < raw.size();) {
+            size_t j = raw.find('\\', i);
+            if (j == std::string_view::npos) {
+                out.append(raw.substr(i));
+                break;
+            }
+            out.append(raw.substr(i, j - i));
+            if (j + 1 < raw.size()) out += raw[j + 1];
+            i = j + 2;
+        }
+    }
+};
+
+struct Version {
+    VersionId id{};
+    VersionId parent{};
+    VersionId merge_parent{};      // second parent of a merge commit, 0 otherwise
+    int64_t   ts_ns{};
+    uint64_t  content_hash{};
+    std::string    message;
+    std::string    content;
+};
+
+// ---- results ----
+
+// The kind of failure, for callers that branch on it. Error::message is the
+// one-line explanation the REPL prints.
+enum class Errc {
+    not_found,          // no such version or branch
+    invalid_argument,   // malformed id or input
+    already_exists,
+    conflict,           // non-fast-forward update, ambiguous hash prefix
+    bad_state,          // detached HEAD, uncommitted changes, merge in progress
+    io,                 // cannot open, read or write a file
+    corrupt,            // malformed save file, pack or repository state
+};
+
+struct Error {
+    Errc   code;
+    std::string message;
+};
+
+template <class T = void>
+using Result = std::expected<T, Error>;
+
+inline std::unexpected<Error> fail(Errc code, std::string message) {
+    return std::unexpected<Error>(Error{code, std::move(message)});
+}
+
+struct CommitResult {
+    VersionId id{};            // the new version, or HEAD if nothing changed
+    bool      unchanged{};     // working content equals the last version; nothing committed
+};
+
+struct MergeOutcome {
+    enum Kind { up_to_date, fast_forward, merged, conflicted } kind{up_to_date};
+    VersionId id{};            // new HEAD for fast_forward and merged
+    VersionId base{};          // merge base for merged and conflicted
+    size_t    conflicts{};     // conflicting hunks left in the working content
+};
+
+// What fast_forward() did to a branch.
+struct RefUpdate {
+    enum Kind { created, up_to_date, already_contains, updated } kind{up_to_date};
+    VersionId from{}, to{};
+};
+
+// Where a repository's memory goes (see Repo::memory_report). Byte counts
+// are heap estimates unless they say otherwise.
+struct MemoryReport {
+    size_t   versions{};
+    uint64_t content_bytes{}, content_heap{};    // total length, and bytes allocated for it
+    uint64_t message_bytes{}, message_heap{};
+    uint64_t history_bytes{};                    // the Version records themselves
+    uint64_t branch_bytes{};                     // branch names and tips
+    uint64_t working_bytes{};                    // working content and its undo journal
+    std::vector<std::pair<const char*, uint64_t>> indexes; // derived structures, by name
+
+    // Versions with a (content hash, size) seen before: what storing each
+    // distinct content once would save.
+    size_t   distinct_contents{};
+    uint64_t duplicate_bytes{};
+
+    std::vector<std::pair<VersionId, uint64_t>> largest;   // content size, largest first
+
+    // Versions that only one branch reaches (or a detached HEAD, as "HEAD"):
+    // what stops being reachable when it is deleted. Content plus message
+    // bytes, largest first.
+    struct Owner {
+        std::string_view name;
+        size_t      versions{};
+        uint64_t    bytes{};
+    };
+    std::vector<Owner> exclusive;
+    Owner unreachable{"(unreachable)"};
+
+    uint64_t total() const {
+        uint64_t n = content_heap + message_heap + history_bytes + branch_bytes + working_bytes;
+        for (const auto& [name, bytes] : indexes) n += bytes;
+        return n;
+    }
+};
+
+struct GcReport {
+    std::vector<VersionId> unreachable;   // ascending
+    uint64_t          bytes{};       // their content and message bytes
+};
+
+struct VerifyReport {
+    size_t versions{};
+    std::vector<std::pair<VersionId, const char*>> bad_versions;   // ascending id, with the problem
+    std::vector<std::pair<std::string, VersionId>>      bad_tips;       // branches whose tip does not exist
+    bool ok() const { return bad_versions.empty() && bad_tips.empty(); }
+};
+
+struct GrepHit {
+    VersionId   id{};
+    size_t      line_no{};     // 1-based line of the first match
+    std::string_view line;          // that line, without its '\n'
+};
+
+// ---- files ----
+
+// The whole of a file, read-only. Regular files are mapped, so the data is
+// paged in straight from the page cache; anything else (a pipe, or a system
+// without mmap) is read into memory. Truncating a mapped file while the
+// view is in use is undefined, as with any mapping.
+class MappedFile {
+public:
+    static Result<MappedFile> open(const std::string& path);
+
+    MappedFile() = default;
+    MappedFile(MappedFile&& o) noexcept
+        : map(std::exchange(o.map, nullptr)), map_size(std::exchange(o.map_size, 0)), owned(std::move(o.owned)) {}
+    MappedFile& operator=(MappedFile o) noexcept {
+        std::swap(map, o.map);
+        std::swap(map_size, o.map_size);
+        std::swap(owned, o.owned);
+        return *this;
+    }
+    ~MappedFile();
+
+    std::string_view view() const { return map ? std::string_view(map, map_size) : std::string_view(owned); }
+
+private:
+    const char* map{};
+    size_t map_size{};
+    std::string owned;
+};
+
+// ---- repository ----
+
+// The state members are public for reading; change them only through the
+// methods, which keep the derived indexes in step. Returned views and spans
+// stay valid until the next call that modifies the repository.
+struct Repo {
+    SegmentedVector<Version> history;   // stable addresses, safe to read while appending
+
+    FlatMap<VersionId> branches;
+    std::string current_branch{"main"};
+    bool detached{false};         
+    VersionId head{0};             
+    VersionId merging{0};          // other side of a merge waiting for its commit
+
+    BlameCache blame_cache;
+
+    TrigramIndex grep_index;
+
+    // Derived per-version data for time queries along first-parent chains, not saved.
+    struct ChainInfo {
+        uint64_t  depth{};     // first-parent distance from the root
+        VersionId jump{};      // skew-binary jump pointer (self for a root)
+        int64_t   max_ts{};    // latest ts_ns up to here; non-decreasing despite clock skew
+    };
+    SegmentedVector<ChainInfo> chain_info;   // indexed by id - 1
+
+    HashIndex hash_index;
+
+    // Replication identity of each version (see find_key), not saved.
+    SegmentedVector<uint64_t> version_keys;    // indexed by id - 1
+    std::unordered_map<uint64_t, VersionId> key_index;
+
+    // branch -> every version reachable from its tip (merge parents included).
+    // Reachable sets are closed under "parent of", which lets updates stop at the
+    // first version already present.
+    FlatMap<RoaringBitmap> reach;
+
+    Repo() {
+        branches[current_branch] = 0;
+        head = 0;
+    }
+
+    static int64_t now_ns() {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    // ---- versions ----
+
+    // Snapshots the working content on the current branch (or detached HEAD).
+    CommitResult commit(std::string msg);
+
+    // Maintains the derived per-version indexes; called once per version in id order.
+    void index_version(const Version& v);
+
+    // Newest version on tip's first-parent chain committed at or before ts_ns,
+    // 0 if none.  Jump pointers skip whole stretches that are too new: O(log n).
+    VersionId as_of(VersionId tip, int64_t ts_ns) const;
+
+    // Parses a version reference: a sequential id, or "0x" followed by 1-16 hex
+    // digits of a content hash (as printed by log).  An ambiguous prefix fails
+    // with the candidates listed in the message.
+    Result<VersionId> resolve_id(std::string_view tok) const;
+
+    const Version* get(VersionId id) const {
+        if (id==0 || id > history.size()) return nullptr;
+        return &history[id-1];
+    }
+
+    Result<std::string_view> content(VersionId id) const {
+        const Version* v = get(id);
+        if (!v) return fail(Errc::not_found, "No such version");
+        return std::string_view(v->content);
+    }
+
+    std::vector<VersionId> chain_from(VersionId tip) const;
+
+    // Lazy first-parent walk from a tip, newest first, holding only the current version.
+    class ChainIter {
+    public:
+        ChainIter(const Repo* r, VersionId tip) : repo(r), cur(r->get(tip)) {}
+        const Version& operator*() const { return *cur; }
+        const Version* operator->() const { return cur; }
+        ChainIter& operator++() {
+            cur = repo->get(cur->parent);
+            return *this;
+        }
+        bool operator==(std::default_sentinel_t) const { return cur == nullptr; }
+
+    private:
+        const Repo* repo;
+        const Version* cur;
+    };
+
+    struct ChainRange {
+        const Repo* repo;
+        VersionId tip;
+        ChainIter begin() const { return {repo, tip}; }
+        std::default_sentinel_t end() const { return {}; }
+    };
+
+    ChainRange walk(VersionId tip) const { return {this, tip}; }
+
+    // Calls visit(const Version&) for tip's first-parent chain, newest first,
+    // and returns how many it visited.  --reverse has to buffer (a singly linked
+    // chain cannot be walked backwards); with a limit that buffer holds at most
+    // `limit` entries.  --until starts the walk at as_of(tip, until); --since
+    // stops it once the chain is older.
+    template <class F>
+    size_t log(VersionId tip, const LogOptions& opt, F&& visit) const {
+        VersionId start = opt.until == INT64_MAX ? tip : as_of(tip, opt.until);
+        std::vector<const Version*> buf;
+        size_t n = 0;
+        for (auto it = walk(start).begin(); it != std::default_sentinel && n < opt.limit; ++it) {
+            if (chain_info[it->id - 1].max_ts < opt.since) break;
+            if (it->ts_ns < opt.since || it->ts_ns > opt.until) continue;
+            if (opt.reverse) buf.push_back(&*it);
+            else visit(*it);
+            ++n;
+        }
+        for (auto r = buf.rbegin(); r != buf.rend(); ++r) visit(**r);
+        return n;
+    }
+
+    // Every version reachable from any branch (or a detached HEAD), each visited
+    // once.  Ids only grow along parent edges, so popping the largest id first
+    // gives a topological order, newest first.
+    template <class F>
+    size_t log_all(const LogOptions& opt, F&& visit) const {
+        std::vector<bool> seen(history.size() + 1);
+        std::priority_queue<VersionId> q;
+        auto push = [&](VersionId id) {
+            if (id != 0 && id <= history.size() && !seen[id]) {
+                seen[id] = true;
+                q.push(id);
+            }
+        };
+        for (const auto& kv : branches) push(kv.second);
+        push(head);
+
+        std::vector<const Version*> buf;
+        size_t n = 0;
+        while (!q.empty() && n < opt.limit) {
+            const Version& v = history[q.top() - 1];
+            q.pop();
+            push(v.parent);
+            push(v.merge_parent);
+            if (v.ts_ns < opt.since || v.ts_ns > opt.until) continue;
+            if (opt.reverse) buf.push_back(&v);
+            else visit(v);
+            ++n;
+        }
+        for (auto r = buf.rbegin(); r != buf.rend(); ++r) visit(**r);
+        return n;
+    }
+
+    // Versions containing `pattern`, newest first, optionally restricted to the
+    // versions reachable from one branch's tip.  Only the trigram index's
+    // candidates are searched.
+    Result<std::vector<GrepHit>> grep(std::string_view pattern, const std::string* branch) const;
+
+    // Line origins of a version: the commit that introduced each of its lines.
+    Result<std::span<const VersionId>> blame(VersionId id);
+
+    // ---- working content ----
+    // Edits made through these calls are journaled for undo and redo. Each is
+    // kept as the text it removed and the text it inserted at one position,
+    // trimmed to the part that changed, so the journal grows with the edited
+    // bytes and not with the document. Anything else that replaces the
+    // working content (checkout, switch, merge, load) clears the journal.
+    // The content itself is private so that no change bypasses the journal.
+    // It is kept in a GapBuffer, so undoing or redoing the latest edits moves
+    // only the edited bytes, not the rest of the document.
+
+    std::string working_content() const { return working.str(); }
+    size_t working_size() const { return working.size(); }
+
+    void set_working(std::string_view text);
+    void append_working(std::string_view text);
+    Result<> erase_working(size_t pos, size_t len);
+    // Replaces up to len bytes at pos with text.
+    Result<> replace_working(size_t pos, size_t len, std::string_view text);
+
+    // Reverts or reapplies up to n edits, newest first; returns how many.
+    size_t undo(size_t n = 1);
+    size_t redo(size_t n = 1);
+
+    // ---- branches ----
+
+    Result<> checkout_version(VersionId id);
+    Result<> switch_branch(const std::string& name);
+    Result<> create_branch(const std::string& name, VersionId at);
+    Result<> delete_branch(const std::string& name);
+
+    // Branches whose history contains id.
+    Result<std::vector<std::string_view>> branches_containing(VersionId id) const;
+
+    // What a collection would drop: versions no branch or HEAD reaches.
+    // Ids double as positions in `history`, so nothing is deleted here.
+    GcReport gc() const;
+
+    // Memory by structure, content duplication, the `top` largest versions
+    // and the versions each branch alone keeps reachable.
+    MemoryReport memory_report(size_t top) const;
+
+    // Re-hashes every version's content (in parallel) and checks the id and
+    // parent links and every branch tip.
+    VerifyReport verify() const;
+
+    // Ids only grow along parent edges, so walking both ancestries highest id
+    // first reaches the nearest common ancestor before anything below it.
+    VersionId merge_base(VersionId a, VersionId b) const;
+
+    // Three-way merge of branch `name` into the current branch. A conflicted
+    // merge leaves markers in the working content and waits for a commit.
+    Result<MergeOutcome> merge_branch(const std::string& name);
+    Result<> abort_merge();
+
+    // ---- replication ----
+    // Peers know a version by its key, not its id. The key hashes the parents'
+    // keys, the timestamp, the content hash and the message. A pack carries
+    // versions oldest first, each one's content either in full or as a line
+    // delta against its first parent. The receiver always has that parent,
+    // either already or earlier in the same pack.
+
+    VersionId find_key(uint64_t key) const {
+        auto it = key_index.find(key);
+        return it == key_index.end() ? 0 : it->second;
+    }
+
+    uint64_t key_of(VersionId id) const { return id ? version_keys[id - 1] : 0; }
+    // Replication key of v from its parents' keys, timestamp, content hash and message.
+    uint64_t version_key(const Version& v) const;
+
+    // First-parent ancestor of id at `depth` (at most id's own depth), in O(log n).
+    VersionId ancestor_at_depth(VersionId id, uint64_t depth) const;
+
+    // Every branch with the key of its tip, in name order.
+    std::vector<std::pair<std::string_view, uint64_t>> refs() const;
+
+    // What a receiver tells the sender it already has: its branch tips, then
+    // ancestors 1, 2, 4, ... steps down each tip's first-parent chain. Anything
+    // missed here is only sent twice, since receivers skip versions they hold.
+    std::vector<uint64_t> have_keys(size_t max) const;
+
+    // Versions reachable from `wants` but not from `common`, oldest first.
+    std::vector<VersionId> missing_versions(const std::vector<VersionId>& wants, const std::vector<VersionId>& common) const;
+
+    void write_pack(const std::vector<VersionId>& ids, std::string& pack) const;
+
+    // Appends the pack's versions that are not known yet and returns how many
+    // that was. On a malformed pack, versions before the bad one are kept.
+    Result<size_t> apply_pack(TextCursor& c);
+
+    // Moves branch `name` to `id` (creating it if needed) when that is a
+    // fast-forward. The checked-out branch also moves HEAD and the working
+    // content, but only if nothing is uncommitted.
+    Result<RefUpdate> fast_forward(const std::string& name, VersionId id);
+
+    // ---- persistence ----
+
+    // One version in the save format.
+    static void append_version(std::string& out, const Version& v);
+
+    Result<> save(const std::string& path) const;
+
+    // Replaces the whole repository. Damaged optional sections are rebuilt;
+    // the returned list says which.
+    Result<std::vector<std::string>> load(const std::string& path);
+
+    // ---- change tracking ----
+
+    // Branches whose tip moved since the last take_ref_changes(), so that
+    // SharedRepo republishes only those. `all` means branches were created or
+    // deleted, or too many moved to list.
+    struct RefChanges {
+        std::vector<std::string> moved;
+        bool all{true};
+    };
+    RefChanges take_ref_changes() { return std::exchange(ref_changes, RefChanges{{}, false}); }
+
+private:
+    static constexpr size_t kMaxMoved = 64;
+    RefChanges ref_changes;
+
+    void tip_moved(const std::string& name) {
+        if (ref_changes.all) return;
+        if (ref_changes.moved.size() == kMaxMoved) return refs_replaced();
+        ref_changes.moved.push_back(name);
+    }
+    void refs_replaced() {
+        ref_changes.all = true;
+        ref_changes.moved.clear();
+    }
+
+    void add_ancestry(RoaringBitmap& bm, VersionId from) const;
+
+    using TipBitmaps = std::unordered_map<VersionId, const RoaringBitmap*>;
+    TipBitmaps tip_bitmaps() const;
+    RoaringBitmap reachable_from(VersionId at) const;
+    RoaringBitmap reachable_from(VersionId at, const TipBitmaps& tips) const;
+
+    // Drops bitmaps of unknown branches and recomputes missing or stale ones.
+    void rebuild_reach();
+
+    const std::vector<VersionId>& line_origins(VersionId id);
+
+    // The `len` bytes at pos replaced `text`. Only the bytes that left the
+    // working content are kept; those that entered are still in it.
+    struct Edit {
+        size_t pos{};
+        size_t len{};
+        std::string text;
+        size_t bytes() const { return sizeof(Edit) + text.size(); }
+    };
+    // Oldest edits are dropped once the undo side holds more than this.
+    static constexpr size_t kJournalBytes = size_t{256} << 20;
+
+    void record(Edit e);
+    Edit revert(const Edit& e);
+    void drop_edits();
+
+    GapBuffer working;
+    std::deque<Edit> undo_log;
+    std::vector<Edit> redo_log;
+    size_t undo_bytes{};
+};
+
+// ---- concurrent access ----
+
+// Epoch-based reclamation for the snapshots below. While a reader holds a
+// snapshot, its slot announces the global epoch it saw. The writer frees a
+// retired object only when every announced epoch is newer than the epoch the
+// object was retired in.
+class EpochDomain {
+    static constexpr uint64_t kIdle = UINT64_MAX;
+    static constexpr size_t kSlots = 256;
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{kIdle};
+        std::atomic<bool> busy{false};
+    };
+
+public:
+    class Guard {
+    public:
+        Guard(Guard&& o) noexcept : slot(std::exchange(o.slot, nullptr)) {}
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+        ~Guard() {
+            if (!slot) return;
+            slot->epoch.store(kIdle, std::memory_order_release);
+            slot->busy.store(false, std::memory_order_release);
+        }
+    private:
+        friend class EpochDomain;
+        explicit Guard(Slot* s) : slot(s) {}
+        Slot* slot;
+    };
+
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+    ~EpochDomain() { for (auto& r : retired) r.second(); }
+
+    // Lock-free as long as fewer than kSlots readers are pinned at once. Beyond
+    // that, extra readers spin until a slot frees up.
+    Guard pin() {
+        size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+        for (size_t i = 0;; ++i) {
+            Slot& s = slots[(start + i) % kSlots];
+            bool expected = false;
+            if (!s.busy.load(std::memory_order_relaxed) &&
+                s.busy.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                // seq_cst store: the announcement is ordered before the caller's
+                // (seq_cst) load of the snapshot pointer.
+                s.epoch.store(global.load());
+                return Guard(&s);
+            }
+            if (i % kSlots == kSlots - 1) std::this_thread::yield();
+        }
+    }
+
+    // Writer side. The caller must serialize these calls, and must already
+    // have unpublished the object.
+    void retire(std::function<void()> deleter) {
+        retired.emplace_back(global.fetch_add(1), std::move(deleter));
+        collect();
+    }
+
+    void collect() {
+        uint64_t oldest = kIdle;
+        for (const Slot& s : slots) oldest = std::min(oldest, s.epoch.load());
+        std::erase_if(retired, [&](auto& r) {
+            if (r.first >= oldest) return false;
+            r.second();
+            return true;
+        });
+    }
+
+private:
+    std::array<Slot, kSlots> slots;
+    std::atomic<uint64_t> global{1};
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+};
+
+// An immutable view of the repository. Versions are read straight from
+// Repo::history, which never moves its elements; a snapshot only looks at
+// the first `count` of them. The sorted branch names are shared between
+// snapshots and only change when a branch is created or deleted. Tips are
+// kept in fixed-size blocks, also shared: a write copies only the blocks
+// whose tips moved.
+struct Snapshot {
+    static constexpr size_t kTipBlock = 64;
+    using TipBlock = std::array<VersionId, kTipBlock>;
+
+    const SegmentedVector<Version>* versions{};
+    size_t count{};
+    const std::vector<std::string>* names{};
+    std::vector<const TipBlock*> tips;      // tip of (*names)[i] at tips[i / kTipBlock][i % kTipBlock]
+    std::string current_branch;
+    bool detached{};
+    VersionId head{};
+    VersionId merging{};
+
+    const Version* get(VersionId id) const {
+        return (id == 0 || id > count) ? nullptr : &(*versions)[id - 1];
+    }
+
+    std::vector<VersionId> chain_from(VersionId tip) const {
+        std::vector<VersionId> out;
+        for (const Version* v = get(tip); v; v = get(v->parent)) out.push_back(v->id);
+        return out;
+    }
+
+    // Repo::log for --limit and --reverse; the time bounds need Repo's
+    // time index and are ignored here.
+    template <class F>
+    size_t log(VersionId tip, const LogOptions& opt, F&& visit) const {
+        std::vector<const Version*> buf;
+        size_t n = 0;
+        for (const Version* v = get(tip); v && n < opt.limit; v = get(v->parent), ++n) {
+            if (opt.reverse) buf.push_back(v);
+            else visit(*v);
+        }
+        for (auto r = buf.rbegin(); r != buf.rend(); ++r) visit(**r);
+        return n;
+    }
+
+    VersionId tip_at(size_t i) const { return (*tips[i / kTipBlock])[i % kTipBlock]; }
+
+    std::optional<VersionId> tip(std::string_view name) const {
+        auto it = std::lower_bound(names->begin(), names->end(), name);
+        if (it == names->end() || *it != name) return std::nullopt;
+        return tip_at(size_t(it - names->begin()));
+    }
+
+    // f(name, tip) for branches starting with prefix, in name order
+    template <class F>
+    void list_branches(F&& f, std::string_view prefix = {}) const {
+        for (auto it = std::lower_bound(names->begin(), names->end(), prefix);
+             it != names->end() && it->starts_with(prefix); ++it)
+            f(std::string_view(*it), tip_at(size_t(it - names->begin())));
+    }
+};
+
+// A Repo shared by one writer and any number of readers. Writers take the
+// lock exclusively, mutate the Repo, and atomically publish a fresh Snapshot.
+// Readers pin an epoch and read the current snapshot without locking; reads
+// a snapshot cannot answer use inspect(), which shares the lock with other
+// inspections. Replaced snapshots, name lists and tip blocks, and a Repo
+// replaced by load(), are freed once no pinned reader can still reach them.
+class SharedRepo {
+public:
+    class Reader {
+    public:
+        const Snapshot& operator*() const { return *snap; }
+        const Snapshot* operator->() const { return snap; }
+    private:
+        friend class SharedRepo;
+        Reader(EpochDomain::Guard g, const Snapshot* s) : guard(std::move(g)), snap(s) {}
+        EpochDomain::Guard guard;
+        const Snapshot* snap;
+    };
+
+    SharedRepo() : repo(std::make_unique<Repo>()) { publish(); }
+    SharedRepo(const SharedRepo&) = delete;
+    SharedRepo& operator=(const SharedRepo&) = delete;
+    ~SharedRepo() {
+        delete current.load();
+        delete names;
+        for (const Snapshot::TipBlock* b : blocks) delete b;
+    }
+
+    Reader read() {
+        EpochDomain::Guard g = epochs.pin();
+        return Reader(std::move(g), current.load());
+    }
+
+    // Runs f(const Repo&) under a shared lock: it waits for a writer, but not
+    // for other inspections or for snapshot readers.
+    template <class F>
+    decltype(auto) inspect(F&& f) {
+        std::shared_lock<std::shared_mutex> lk(writer);
+        return f(static_cast<const Repo&>(*repo));
+    }
+
+    // Runs f(Repo&) under the writer lock, then publishes. f must not replace
+    // or shrink history; use load() for that.
+    template <class F>
+    decltype(auto) write(F&& f) {
+        std::unique_lock<std::shared_mutex> lk(writer);
+        if constexpr (std::is_void_v<std::invoke_result_t<F, Repo&>>) {
+            f(*repo);
+            publish();
+        } else {
+            decltype(auto) r = f(*repo);
+            publish();
+            return r;
+        }
+    }
+
+    Result<std::vector<std::string>> load(const std::string& path) {
+        auto fresh = std::make_unique<Repo>();
+        Result<std::vector<std::string>> r = fresh->load(path);
+        if (!r) return r;
+        std::unique_lock<std::shared_mutex> lk(writer);
+        Repo* old = repo.release();
+        repo = std::move(fresh);
+        publish();
+        epochs.retire([old] { delete old; });
+        return r;
+    }
+
+private:
+    using TipBlock = Snapshot::TipBlock;
+
+    // Anything the previous snapshot still points at is retired only after the
+    // new one is published. Unless branches were created or deleted, only the
+    // blocks holding moved tips are copied.
+    void publish() {
+        Repo& r = *repo;
+        Repo::RefChanges changes = r.take_ref_changes();
+        const std::vector<std::string>* old_names = nullptr;
+        std::vector<const TipBlock*> old_blocks;
+
+        std::vector<std::pair<size_t, VersionId>> moved;    // (index in names, new tip)
+        for (size_t k = 0; !changes.all && k < changes.moved.size(); ++k) {
+            const std::string& nm = changes.moved[k];
+            auto it = std::lower_bound(names->begin(), names->end(), nm);
+            if (it == names->end() || *it != nm) changes.all = true;
+            else moved.emplace_back(size_t(it - names->begin()), r.branches.at(nm));
+        }
+        if (changes.all) {
+            auto* nn = new std::vector<std::string>;
+            nn->reserve(r.branches.size());
+            old_blocks.swap(blocks);
+            TipBlock* b = nullptr;
+            for (const auto& [nm, hid] : r.branches) {
+                size_t i = nn->size() % Snapshot::kTipBlock;
+                if (i == 0) blocks.push_back(b = new TipBlock{});
+                (*b)[i] = hid;
+                nn->push_back(nm);
+            }
+            old_names = std::exchange(names, nn);
+        } else {
+            std::sort(moved.begin(), moved.end());
+            for (size_t k = 0; k < moved.size();) {
+                size_t blk = moved[k].first / Snapshot::kTipBlock;
+                auto* nb = new TipBlock(*blocks[blk]);
+                for (; k < moved.size() && moved[k].first / Snapshot::kTipBlock == blk; ++k)
+                    (*nb)[moved[k].first % Snapshot::kTipBlock] = moved[k].second;
+                old_blocks.push_back(std::exchange(blocks[blk], nb));
+            }
+        }
+
+        auto* s = new Snapshot;
+        s->versions = &r.history;
+        s->count = r.history.size();
+        s->names = names;
+        s->tips = blocks;
+        s->current_branch = r.current_branch;
+        s->detached = r.detached;
+        s->head = r.head;
+        s->merging = r.merging;
+
+        const Snapshot* old = current.exchange(s);
+        if (old || old_names || !old_blocks.empty())
+            epochs.retire([old, old_names, old_blocks = std::move(old_blocks)] {
+                delete old;
+                delete old_names;
+                for (const TipBlock* b : old_blocks) delete b;
+            });
+    }
+
+    std::shared_mutex writer;
+    std::unique_ptr<Repo> repo;
+    EpochDomain epochs;
+    std::atomic<const Snapshot*> current{nullptr};
+    const std::vector<std::string>* names{};
+    std::vector<const TipBlock*> blocks;     // those of the current snapshot
+};
+
+} // namespace vcs
@@ -0,0 +1,327 @@
+// Synthetic repository generator (the `repogen` target). Writes a repository
+// in the save format that `load` reads, for reproducing scaling problems with
+// histories far larger than any hand-made fixture. Output is streamed: memory
+// holds one working copy per branch and a write buffer, never the history,
+// so the file size is limited only by the disk. The same seed and parameters
+// always give the same file.
+//
+// Model: the root commit starts `main`. Branch k of B is forked before commit
+// k*N/B; each later commit goes to a branch picked with Zipf weights (the
+// older the branch, the busier), makes a few line edits and then grows or
+// shrinks its content towards a target size. The optional trigram and reach
+// sections are left out; load rebuilds them.
+#include "repo.h"
+
+#include <bits/stdc++.h>
+
+using namespace std;
+using namespace vcs;
+
+namespace {
+
+struct Params {
+    uint64_t commits{1000};
+    uint64_t branches{8};         // including main
+    bool     mesh{false};         // star: fork from and merge into main; mesh: any branch
+    double   merge_rate{0.05};    // chance that a commit is a merge
+    double   skew{1.0};           // Zipf exponent of branch activity; 0 is uniform
+    uint64_t size{4096};          // median content size in bytes
+    enum { fixed, uniform, lognormal } dist{lognormal};
+    double   sigma{1.0};          // lognormal shape
+    uint64_t max_size{256u << 20};
+    double   resize_rate{0.02};   // chance that a commit draws a new target size
+    uint64_t edits{3};            // line edits per commit
+    double   locality{0.8};       // chance that an edit lands near the previous one
+    int64_t  start{1700000000};   // timestamp of the root, seconds since the epoch
+    uint64_t interval{600};       // mean seconds between commits
+    uint64_t seed{1};
+    string   out_path;            // stdout if empty
+};
+
+struct Branch {
+    string    name;
+    VersionId tip{};
+    string    content;
+    size_t    target{};           // size the edits drift towards
+    size_t    last_edit{};
+};
+
+class Generator {
+public:
+    Generator(const Params& p, ostream& os) : p(p), os(os), rng(p.seed) {}
+
+    bool run() {
+        buf.reserve(kFlush + (1 << 16));
+        buf += "count ";
+        append_number(buf, p.commits);
+        buf += '\n';
+
+        ts_ns = p.start * 1000000000;
+        for (uint64_t k = 0; k < p.branches; ++k) {
+            double w = 1.0 / pow(double(k + 1), p.skew);
+            cum_weight.push_back((k ? cum_weight.back() : 0.0) + w);
+        }
+
+        for (VersionId id = 1; id <= p.commits; ++id) {
+            while (branches.size() < p.branches && (branches.empty() || (id - 1) * p.branches >= branches.size() * p.commits))
+                fork();
+            commit(id, pick_branch());
+            if (buf.size() >= kFlush && !flush()) return false;
+        }
+        while (branches.size() < p.branches) fork();   // more branches than commits
+
+        // packed refs, front-coded in name order as save writes them
+        vector<const Branch*> sorted;
+        for (const Branch& b : branches) sorted.push_back(&b);
+        sort(sorted.begin(), sorted.end(), [](auto* a, auto* b) { return a->name < b->name; });
+        buf += "packed-refs ";
+        append_number(buf, sorted.size());
+        buf += '\n';
+        string_view prev;
+        for (const Branch* b : sorted) {
+            size_t shared = 0;
+            while (shared < min(prev.size(), b->name.size()) && prev[shared] == b->name[shared]) ++shared;
+            append_number(buf, shared);
+            buf += ' ';
+            append_quoted(buf, string_view(b->name).substr(shared));
+            buf += ' ';
+            append_number(buf, b->tip);
+            buf += '\n';
+            prev = b->name;
+        }
+        buf += "current_branch \"main\"\ndetached 0\nhead ";
+        append_number(buf, branches[0].tip);
+        buf += '\n';
+        return flush() && os.flush();
+    }
+
+    uint64_t bytes_written() const { return written; }
+
+private:
+    static constexpr size_t kFlush = 1 << 20;
+
+    const Params& p;
+    ostream& os;
+    mt19937_64 rng;
+    string buf;
+    uint64_t written{};
+    int64_t ts_ns{};
+    deque<Branch> branches;       // stable references while forking
+    vector<double> cum_weight;    // Zipf weights of branches in creation order
+    Version v;                    // reused for formatting
+
+    bool flush() {
+        os.write(buf.data(), streamsize(buf.size()));
+        written += buf.size();
+        buf.clear();
+        return bool(os);
+    }
+
+    double uniform01() { return double(rng() >> 11) * 0x1.0p-53; }
+    size_t below(size_t n) { return n ? size_t(rng() % n) : 0; }
+
+    size_t draw_size() {
+        double s = double(p.size);
+        if (p.dist == Params::uniform) {
+            s *= 0.5 + uniform01();
+        } else if (p.dist == Params::lognormal) {
+            // Box-Muller; the median stays at `size`
+            double u1 = uniform01(), u2 = uniform01();
+            double z = sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * numbers::pi * u2);
+            s *= exp(p.sigma * z);
+        }
+        return size_t(min(s, double(p.max_size)));
+    }
+
+    void append_line(string& s) {
+        static const char* words[] = {"alpha", "beta",  "gamma", "delta", "kappa", "omega", "sigma", "theta",
+                                      "lorem", "ipsum", "dolor", "amet",  "quux",  "zeta",  "eta",   "iota"};
+        for (size_t n = 3 + below(8); n > 0; --n) {
+            s += words[rng() & 15];
+            s += n > 1 ? ' ' : '\n';
+        }
+    }
+
+    Branch& pick_branch() {
+        double r = uniform01() * cum_weight[branches.size() - 1];
+        size_t k = size_t(lower_bound(cum_weight.begin(), cum_weight.begin() + branches.size(), r) - cum_weight.begin());
+        return branches[min(k, branches.size() - 1)];
+    }
+
+    void fork() {
+        Branch b;
+        if (branches.empty()) {
+            b.name = "main";
+            b.target = draw_size();
+        } else {
+            const Branch& from = p.mesh ? branches[below(branches.size())] : branches[0];
+            b.name = "topic-" + to_string(branches.size());
+            b.tip = from.tip;
+            b.content = from.content;
+            b.target = from.target;
+            b.last_edit = from.last_edit;
+        }
+        branches.push_back(std::move(b));
+    }
+
+    // Start of the line holding byte `pos`.
+    static size_t line_start(const string& s, size_t pos) {
+        size_t nl = pos ? s.rfind('\n', pos - 1) : string::npos;
+        return nl == string::npos ? 0 : nl + 1;
+    }
+
+    size_t edit_pos(Branch& b) {
+        string& s = b.content;
+        if (s.empty()) return 0;
+        size_t pos;
+        if (uniform01() < p.locality) {
+            size_t lo = b.last_edit > 2048 ? b.last_edit - 2048 : 0;
+            pos = min(s.size() - 1, lo + below(4096));
+        } else {
+            pos = below(s.size());
+        }
+        return b.last_edit = line_start(s, pos);
+    }
+
+    void edit(Branch& b) {
+        if (uniform01() < p.resize_rate) b.target = draw_size();
+        string& s = b.content;
+        string line;
+        for (uint64_t e = 0; e < p.edits; ++e) {
+            size_t at = edit_pos(b);
+            size_t end = s.find('\n', at);
+            end = end == string::npos ? s.size() : end + 1;
+            line.clear();
+            append_line(line);
+            s.replace(at, end - at, line);
+        }
+        // drift towards the target around the last edit
+        size_t at = edit_pos(b);
+        if (s.size() < b.target) {
+            line.clear();
+            while (line.size() < b.target - s.size()) append_line(line);
+            s.insert(at, line);
+        } else if (s.size() > b.target) {
+            size_t cut = s.size() - b.target;
+            if (at + cut > s.size()) at = s.size() - cut;
+            s.erase(at, cut);
+            b.last_edit = line_start(s, at);
+        }
+    }
+
+    void commit(VersionId id, Branch& b) {
+        v.id = id;
+        v.parent = b.tip;
+        v.merge_parent = 0;
+        v.message.clear();
+        if (id > 1 && branches.size() > 1 && uniform01() < p.merge_rate && (p.mesh || &b == &branches[0])) {
+            size_t k = 1 + below(branches.size() - 1);
+            Branch& other = p.mesh ? branches[(size_t(&b - &branches[0]) + k) % branches.size()] : branches[k];
+            if (other.tip && other.tip != b.tip) {
+                v.merge_parent = other.tip;
+                v.message = "Merge " + other.name + " into " + b.name;
+                // take over a stretch of the other side, as a merge would
+                size_t n = min(other.content.size(), size_t(1024 + below(16384)));
+                size_t from = line_start(other.content, below(other.content.size() - n + 1));
+                b.content.insert(min(b.last_edit, b.content.size()), other.content, from, n);
+            }
+        }
+        edit(b);
+        if (v.message.empty()) v.message = "Commit " + to_string(id) + " on " + b.name;
+        int64_t secs = int64_t(1 + below(2 * p.interval));
+        ts_ns += secs * 1000000000 + int64_t(below(1000000000));
+        v.ts_ns = ts_ns;
+        v.content_hash = hash64(b.content);
+        v.content.swap(b.content);
+        Repo::append_version(buf, v);
+        v.content.swap(b.content);
+        b.tip = id;
+    }
+};
+
+int usage(const char* argv0) {
+    cerr << "usage: " << argv0 << " [options] [-o PATH]\n"
+         << "  --commits N          versions to generate (1000)\n"
+         << "  --branches B         branches including main (8)\n"
+         << "  --topology T         star: fork from and merge into main; mesh: any branch (star)\n"
+         << "  --merge-rate P       chance that a commit merges another branch (0.05)\n"
+         << "  --skew S             Zipf exponent of branch activity, 0 = uniform (1)\n"
+         << "  --size BYTES         median content size (4096)\n"
+         << "  --size-dist D        fixed, uniform (0.5x-1.5x) or lognormal (lognormal)\n"
+         << "  --sigma S            lognormal shape (1)\n"
+         << "  --max-size BYTES     cap on content size (268435456)\n"
+         << "  --resize-rate P      chance that a commit draws a new target size (0.02)\n"
+         << "  --edits K            line edits per commit (3)\n"
+         << "  --locality P         chance that an edit lands near the previous one (0.8)\n"
+         << "  --start SECONDS      timestamp of the root commit (1700000000)\n"
+         << "  --interval SECONDS   mean time between commits (600)\n"
+         << "  --seed N             random seed (1)\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Params p;
+    for (int i = 1; i < argc; ++i) {
+        string_view a = argv[i];
+        if (i + 1 >= argc) return usage(argv[0]);
+        string_view val = argv[++i];
+        auto num = [&](uint64_t& x) { return parse_number(val, x); };
+        auto real = [&](double& x, double lo, double hi) {
+            auto [end, ec] = from_chars(val.data(), val.data() + val.size(), x);
+            return ec == errc() && end == val.data() + val.size() && x >= lo && x <= hi;
+        };
+        uint64_t start = 0;
+        bool ok = true;
+        if (a == "-o" || a == "--out") p.out_path = val;
+        else if (a == "--commits") ok = num(p.commits);
+        else if (a == "--branches") ok = num(p.branches) && p.branches >= 1;
+        else if (a == "--topology") ok = (p.mesh = val == "mesh") || val == "star";
+        else if (a == "--merge-rate") ok = real(p.merge_rate, 0, 1);
+        else if (a == "--skew") ok = real(p.skew, 0, 100);
+        else if (a == "--size") ok = num(p.size);
+        else if (a == "--size-dist") {
+            if (val == "fixed") p.dist = Params::fixed;
+            else if (val == "uniform") p.dist = Params::uniform;
+            else if (val == "lognormal") p.dist = Params::lognormal;
+            else ok = false;
+        }
+        else if (a == "--sigma") ok = real(p.sigma, 0, 10);
+        else if (a == "--max-size") ok = num(p.max_size);
+        else if (a == "--resize-rate") ok = real(p.resize_rate, 0, 1);
+        else if (a == "--edits") ok = num(p.edits);
+        else if (a == "--locality") ok = real(p.locality, 0, 1);
+        else if (a == "--start") {
+            ok = num(start) && start < uint64_t(INT64_MAX / 1000000000 / 2);
+            p.start = int64_t(start);
+        }
+        else if (a == "--interval") ok = num(p.interval) && p.interval >= 1;
+        else if (a == "--seed") ok = num(p.seed);
+        else ok = false;
+        if (!ok) return usage(argv[0]);
+    }
+
+    ofstream file;
+    if (!p.out_path.empty()) {
+        file.open(p.out_path, ios::binary);
+        if (!file) {
+            cerr << "cannot open " << p.out_path << " for write\n";
+            return 1;
+        }
+    } else {
+        ios::sync_with_stdio(false);
+    }
+    ostream& os = p.out_path.empty() ? cout : file;
+
+    auto t0 = chrono::steady_clock::now();
+    Generator gen(p, os);
+    if (!gen.run()) {
+        cerr << "write failed\n";
+        return 1;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cerr << p.commits << " versions, " << p.branches << " branches, " << (gen.bytes_written() >> 20) << " MiB in "
+         << fixed << setprecision(1) << secs << " s\n";
+    return 0;
+}